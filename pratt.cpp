@@ -1,70 +1,1004 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <compare>
+#include <condition_variable>
 #include <cstddef>
 #include <format>
 #include <iostream>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <ostream>
+#include <span>
 #include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <variant>
 #include <vector>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pratt_shm.h"
+
+#ifdef PRATT_LIBRARY
+#include "pratt.h"
+#endif
+
 using u8 = uint8_t;
+using u16 = uint16_t;
+using i32 = int32_t;
+using u32 = uint32_t;
 using i64 = int64_t;
 using u64 = uint64_t;
+using i128 = __int128;
+using u128 = unsigned __int128;
 using usize = size_t;
 using isize = ptrdiff_t;
 using f32 = float;
 using f64 = double;
 
-using std::string, std::vector, std::cout, std::endl, std::format;
-using std::unique_ptr, std::make_unique, std::pair, std::optional;
+using std::string, std::string_view, std::vector, std::cout, std::endl, std::format;
+using std::unique_ptr, std::make_unique, std::shared_ptr, std::make_shared, std::pair, std::optional;
 
-constexpr i64 powu(i64 x, usize p) {
-  // special casing
-  switch(p) {
-    case (0): return 1;
-    case (1): return x;
-    case (2): return x*x;
-    case (3): return x*x*x;
-    case (4): return x*x*x*x;
-    default:
-      break;
-  }
+constexpr u64 hash_mix(u64 h, u64 x) {
+  // splitmix64 finalizer over the combined value
+  u64 z = h * 0x9e3779b97f4a7c15 + x + 0x632be59bd9b4e019;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+// FNV-1a
+constexpr u64 hash_bytes(string_view s) {
+  u64 h = 0xcbf29ce484222325;
+  for (char c: s) h = (h ^ (u8)c) * 0x100000001b3;
+  return h;
+}
 
-  // power by repeated squaring
-  i64 res = x;
-  i64 p_cur = 1;
-  while (2*p_cur < p) {
-    res = res*res;
-    p_cur *= 2;
+template <typename T>
+string int_str(T x) {
+  if constexpr (sizeof(T) <= sizeof(i64)) {
+    return format("{}", x);
+  } else {
+    // std::format has no portable __int128 support
+    u128 mag = x < 0 ? -(u128)x : (u128)x;
+    string s;
+    do {
+      s += (char)('0' + mag % 10);
+      mag /= 10;
+    } while (mag != 0);
+    if (x < 0) s += '-';
+    return {s.rbegin(), s.rend()};
   }
+}
 
-  i64 remainder = p - p_cur;
-  return res * powu(x, remainder);
+// Exponentiation by squaring, or nullopt on overflow
+template <typename T>
+constexpr optional<T> powu(T x, u64 p) {
+  T res = 1;
+  while (true) {
+    if ((p & 1) && __builtin_mul_overflow(res, x, &res)) return {};
+    p >>= 1;
+    if (p == 0) return res;
+    // x^(2^k) divides the result from here on, so if it overflows so does the result
+    if (__builtin_mul_overflow(x, x, &x)) return {};
+  }
 }
 
-i64 powi(i64 x, i64 p) {
+template <typename T>
+T powi(T x, T p) {
   if (p < 0) throw std::runtime_error("Integer cannot be raised to negative power");
-  return powu(x, (usize)p);
+  auto res = powu(x, (u64)p);
+  if (!res.has_value()) throw std::runtime_error(format("{}^{} will overflow!", int_str(x), int_str(p)));
+  return res.value();
 }
 
-i64 factorial_unchecked(i64 x) {
-  if (x == 0 || x == 1) {
-    return 1;
+template <typename T>
+T factorial(T x) {
+  if (x < 0) {
+    throw std::runtime_error(format("Factorial of negative integer {} is not defined", int_str(x)));
   }
-  return x * factorial_unchecked(x-1);
+  T res = 1;
+  for (T i = 2; i <= x; i++) {
+    if (__builtin_mul_overflow(res, i, &res)) throw std::runtime_error(format("{}! will overflow!", int_str(x)));
+  }
+  return res;
 }
 
-i64 factorial(i64 x) {
-  if (x > 21) {
-    throw std::runtime_error(format("{}! will overflow!", x));
+//== Arbitrary precision integers ====={{{
+struct BigInt {
+  // Sign and magnitude. The magnitude is little-endian base 2^32 with no
+  // leading zero limbs, so zero is the empty vector and is never negative.
+  bool negative = false;
+  vector<u32> mag;
+
+  BigInt() = default;
+  BigInt(i64 x): negative(x < 0) {
+    u64 m = x < 0 ? -(u64)x : (u64)x;
+    for (; m != 0; m >>= 32) mag.push_back((u32)m);
   }
-  if (x < 0) {
-    throw std::runtime_error(format("Factorial of negative integer {} is not defined", x));
+
+  bool is_zero() const { return mag.empty(); }
+
+  u64 hash() const {
+    u64 h = negative;
+    for (u32 limb: mag) h = hash_mix(h, limb);
+    return h;
   }
-  return factorial_unchecked(x);
-}
+
+  // Bits in the magnitude, 0 for zero
+  usize bits() const { return mag.empty() ? 0 : mag.size() * 32 - std::countl_zero(mag.back()); }
+
+  optional<i64> to_i64() const {
+    if (mag.size() > 2) return {};
+    u64 m = 0;
+    for (usize i = mag.size(); i-- > 0;) m = m << 32 | mag[i];
+    if (negative) {
+      if (m > (u64)1 << 63) return {};
+      return (i64)(0 - m);
+    }
+    if (m > (u64)std::numeric_limits<i64>::max()) return {};
+    return (i64)m;
+  }
+
+  static void trim(vector<u32>& a) {
+    while (!a.empty() && a.back() == 0) a.pop_back();
+  }
+
+  static int cmp_mag(const vector<u32>& a, const vector<u32>& b) {
+    if (a.size() != b.size()) return a.size() < b.size() ? -1 : 1;
+    for (usize i = a.size(); i-- > 0;) {
+      if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+  }
+
+  static vector<u32> add_mag(const vector<u32>& a, const vector<u32>& b) {
+    const auto& [lo, hi] = a.size() < b.size() ? std::tie(a, b) : std::tie(b, a);
+    vector<u32> res(hi.size() + 1);
+    u64 carry = 0;
+    for (usize i = 0; i < hi.size(); i++) {
+      carry += (u64)hi[i] + (i < lo.size() ? lo[i] : 0);
+      res[i] = (u32)carry;
+      carry >>= 32;
+    }
+    res.back() = (u32)carry;
+    trim(res);
+    return res;
+  }
+
+  // a -= b, requires |a| >= |b|
+  static void sub_mag(vector<u32>& a, const vector<u32>& b) {
+    i64 borrow = 0;
+    for (usize i = 0; i < a.size(); i++) {
+      borrow += (i64)a[i] - (i < b.size() ? b[i] : 0);
+      a[i] = (u32)borrow;
+      borrow = borrow < 0 ? -1 : 0;
+    }
+    trim(a);
+  }
+
+  static vector<u32> mul_mag(const vector<u32>& a, const vector<u32>& b) {
+    if (a.empty() || b.empty()) return {};
+    vector<u32> res(a.size() + b.size());
+    for (usize i = 0; i < a.size(); i++) {
+      u64 carry = 0;
+      for (usize j = 0; j < b.size(); j++) {
+        carry += (u64)a[i] * b[j] + res[i + j];
+        res[i + j] = (u32)carry;
+        carry >>= 32;
+      }
+      res[i + b.size()] = (u32)carry;
+    }
+    trim(res);
+    return res;
+  }
+
+  // a = a*m + c
+  static void mul_add_small(vector<u32>& a, u32 m, u32 c) {
+    u64 carry = c;
+    for (auto& limb: a) {
+      carry += (u64)limb * m;
+      limb = (u32)carry;
+      carry >>= 32;
+    }
+    if (carry != 0) a.push_back((u32)carry);
+  }
+
+  // a /= d, returning the remainder
+  static u32 div_small(vector<u32>& a, u32 d) {
+    u64 rem = 0;
+    for (usize i = a.size(); i-- > 0;) {
+      rem = rem << 32 | a[i];
+      a[i] = (u32)(rem / d);
+      rem %= d;
+    }
+    trim(a);
+    return (u32)rem;
+  }
+
+  // Truncating division of magnitudes: shift-and-subtract, one bit at a time
+  static pair<vector<u32>, vector<u32>> divmod_mag(const vector<u32>& a, const vector<u32>& b) {
+    if (b.empty()) throw std::runtime_error("Division by zero");
+    if (b.size() == 1) {
+      vector<u32> q = a;
+      u32 r = div_small(q, b[0]);
+      return {q, r == 0 ? vector<u32>{} : vector<u32>{r}};
+    }
+    vector<u32> q(a.size()), r;
+    for (usize i = a.size() * 32; i-- > 0;) {
+      u32 carry = (a[i / 32] >> (i % 32)) & 1;
+      for (auto& limb: r) {
+        u32 top = limb >> 31;
+        limb = limb << 1 | carry;
+        carry = top;
+      }
+      if (carry != 0) r.push_back(carry);
+      if (cmp_mag(r, b) >= 0) {
+        sub_mag(r, b);
+        q[i / 32] |= (u32)1 << (i % 32);
+      }
+    }
+    trim(q);
+    return {q, r};
+  }
+
+  static BigInt make(bool negative, vector<u32> mag) {
+    BigInt res;
+    res.negative = negative && !mag.empty();
+    res.mag = std::move(mag);
+    return res;
+  }
+
+  friend BigInt operator-(const BigInt& x) { return make(!x.negative, x.mag); }
+
+  friend BigInt operator+(const BigInt& a, const BigInt& b) {
+    if (a.negative == b.negative) return make(a.negative, add_mag(a.mag, b.mag));
+    if (cmp_mag(a.mag, b.mag) >= 0) {
+      auto m = a.mag;
+      sub_mag(m, b.mag);
+      return make(a.negative, std::move(m));
+    }
+    auto m = b.mag;
+    sub_mag(m, a.mag);
+    return make(b.negative, std::move(m));
+  }
+
+  friend BigInt operator-(const BigInt& a, const BigInt& b) { return a + (-b); }
+
+  friend BigInt operator*(const BigInt& a, const BigInt& b) {
+    return make(a.negative != b.negative, mul_mag(a.mag, b.mag));
+  }
+
+  // Truncates toward zero, like the builtin integer types
+  friend BigInt operator/(const BigInt& a, const BigInt& b) {
+    return make(a.negative != b.negative, divmod_mag(a.mag, b.mag).first);
+  }
+
+  friend BigInt operator%(const BigInt& a, const BigInt& b) {
+    return make(a.negative, divmod_mag(a.mag, b.mag).second);
+  }
+
+  friend bool operator==(const BigInt& a, const BigInt& b) = default;
+
+  friend std::strong_ordering operator<=>(const BigInt& a, const BigInt& b) {
+    if (a.negative != b.negative) return a.negative ? std::strong_ordering::less : std::strong_ordering::greater;
+    int c = a.negative ? cmp_mag(b.mag, a.mag) : cmp_mag(a.mag, b.mag);
+    return c <=> 0;
+  }
+
+  // Decimal digits, optionally separated by '_'
+  static optional<BigInt> parse(string_view text) {
+    BigInt res;
+    if (text.empty()) return {};
+    for (u8 c: text) {
+      if (c == '_') continue;
+      if (c < '0' || c > '9') return {};
+      mul_add_small(res.mag, 10, c - '0');
+    }
+    trim(res.mag);
+    return res;
+  }
+
+  string str() const {
+    if (is_zero()) return "0";
+    vector<u32> m = mag;
+    vector<u32> chunks;
+    while (!m.empty()) chunks.push_back(div_small(m, 1'000'000'000));
+    string s = format("{}{}", negative ? "-" : "", chunks.back());
+    for (usize i = chunks.size() - 1; i-- > 0;) s += format("{:09}", chunks[i]);
+    return s;
+  }
+};
+//== end arbitrary precision integers }}}
+
+//== Numeric backends ====={{{
+// A backend supplies the value type the evaluator computes in, how literals
+// are read into it and the arithmetic behind each operator. Op, Expr and
+// Parser are templated on it, so every backend shares the same parser and
+// operator tables and evaluation dispatches statically.
+//
+// EXACT says whether + and * are exactly associative, with no rounding and no
+// overflow, so that rewrites may regroup and reorder their operands.
+
+// Fixed-width two's complement integers. Every operation is checked and
+// reports overflow instead of wrapping.
+template <typename T>
+struct IntArith {
+  using Value = T;
+  static constexpr bool EXACT = false;
+
+  static constexpr const char* name() {
+    if constexpr (sizeof(T) == 4) return "i32";
+    else if constexpr (sizeof(T) == 8) return "i64";
+    else return "i128";
+  }
+
+  [[noreturn]] void overflow(Value l, const char* sym, Value r) const {
+    throw std::runtime_error(format("{} {} {} overflows {}", int_str(l), sym, int_str(r), name()));
+  }
+
+  Value literal(string_view text) const {
+    Value acc = 0;
+    for (u8 c: text) {
+      if (c == '_') continue;
+      if (c < '0' || c > '9') throw std::runtime_error(format("Invalid integer literal \"{}\"", text));
+      if (__builtin_mul_overflow(acc, 10, &acc) || __builtin_add_overflow(acc, c - '0', &acc)) {
+        throw std::runtime_error(format("Integer literal {} does not fit in {}", text, name()));
+      }
+    }
+    return acc;
+  }
+  Value pos(Value x) const { return x; }
+  Value neg(Value x) const {
+    if (x == std::numeric_limits<Value>::min()) overflow(0, "-", x);
+    return -x;
+  }
+  Value add(Value l, Value r) const {
+    Value res;
+    if (__builtin_add_overflow(l, r, &res)) overflow(l, "+", r);
+    return res;
+  }
+  Value sub(Value l, Value r) const {
+    Value res;
+    if (__builtin_sub_overflow(l, r, &res)) overflow(l, "-", r);
+    return res;
+  }
+  Value mul(Value l, Value r) const {
+    Value res;
+    if (__builtin_mul_overflow(l, r, &res)) overflow(l, "*", r);
+    return res;
+  }
+  Value div(Value l, Value r) const {
+    if (r == 0) throw std::runtime_error("Division by zero");
+    if (r == -1 && l == std::numeric_limits<Value>::min()) overflow(l, "/", r);
+    return l / r;
+  }
+  Value pow(Value l, Value r) const { return powi(l, r); }
+  Value fact(Value x) const { return factorial(x); }
+  string str(Value x) const { return int_str(x); }
+  u64 hash(Value x) const {
+    if constexpr (sizeof(Value) > sizeof(u64)) return hash_mix((u64)((u128)x >> 64), (u64)x);
+    else return (u64)(i64)x;
+  }
+
+  using Unsigned = std::make_unsigned_t<Value>;
+
+  static Unsigned magnitude(Value x) { return x < 0 ? -(Unsigned)x : (Unsigned)x; }
+
+  // Left to right with the checked add, when some partial sum may overflow.
+  // Otherwise in four independent wrapping accumulators, which the compiler
+  // vectorizes: if |acc| + n * max|x| fits, no partial sum in any order can
+  // overflow, and the wrapped result is exact.
+  Value sum(Value acc, std::span<Value> values) const {
+    Unsigned max = 0;
+    for (Value x: values) max = std::max(max, magnitude(x));
+    Unsigned bound;
+    if (__builtin_mul_overflow(max, (Unsigned)values.size(), &bound) ||
+        __builtin_add_overflow(bound, magnitude(acc), &bound) || bound > (Unsigned)std::numeric_limits<Value>::max()) {
+      for (Value x: values) acc = add(acc, x);
+      return acc;
+    }
+    Unsigned s[4] = {(Unsigned)acc, 0, 0, 0};
+    usize i = 0;
+    for (; i + 4 <= values.size(); i += 4) {
+      for (usize k = 0; k < 4; k++) s[k] += (Unsigned)values[i + k];
+    }
+    for (; i < values.size(); i++) s[0] += (Unsigned)values[i];
+    return (Value)(s[0] + s[1] + s[2] + s[3]);
+  }
+
+  // Same idea: a partial product has at most as many bits as the sum of its
+  // factors' bit widths, so if those add up to less than the width of Value
+  // the product cannot overflow in any order.
+  Value product(Value acc, std::span<Value> values) const {
+    usize bits = std::bit_width(magnitude(acc));
+    for (Value x: values) bits += std::bit_width(magnitude(x));
+    if (bits > (usize)std::numeric_limits<Value>::digits) {
+      for (Value x: values) acc = mul(acc, x);
+      return acc;
+    }
+    Unsigned p[4] = {(Unsigned)acc, 1, 1, 1};
+    usize i = 0;
+    for (; i + 4 <= values.size(); i += 4) {
+      for (usize k = 0; k < 4; k++) p[k] *= (Unsigned)values[i + k];
+    }
+    for (; i < values.size(); i++) p[0] *= (Unsigned)values[i];
+    return (Value)(p[0] * p[1] * p[2] * p[3]);
+  }
+};
+
+using I32Arith = IntArith<i32>;
+using I64Arith = IntArith<i64>;
+using I128Arith = IntArith<i128>;
+
+struct BigArith {
+  using Value = BigInt;
+  static constexpr bool EXACT = true;
+
+  // n! for larger n has hundreds of thousands of digits
+  static constexpr i64 MAX_FACTORIAL = 1 << 14;
+  // Likewise the largest power, in bits
+  static constexpr u64 MAX_POWER_BITS = 1 << 20;
+
+  // Whether x^e, where x has `bits` bits, has more than MAX_POWER_BITS. It has
+  // at least (bits - 1) * e + 1, and 0, 1 and -1 stay that small.
+  static bool power_too_large(usize bits, u64 e) {
+    u64 res;
+    return bits > 1 && (__builtin_mul_overflow((u64)bits - 1, e, &res) || res >= MAX_POWER_BITS);
+  }
+
+  Value literal(string_view text) const {
+    auto res = BigInt::parse(text);
+    if (!res.has_value()) throw std::runtime_error(format("Invalid integer literal \"{}\"", text));
+    return res.value();
+  }
+  Value pos(const Value& x) const { return x; }
+  Value neg(const Value& x) const { return -x; }
+  Value add(const Value& l, const Value& r) const { return l + r; }
+  Value sub(const Value& l, const Value& r) const { return l - r; }
+  Value mul(const Value& l, const Value& r) const { return l * r; }
+  Value div(const Value& l, const Value& r) const { return l / r; }
+
+  Value pow(Value l, const Value& r) const {
+    if (r.negative) throw std::runtime_error("Integer cannot be raised to negative power");
+    auto e = r.to_i64();
+    if (!e.has_value() || power_too_large(l.bits(), (u64)e.value())) {
+      throw std::runtime_error(format("Exponent {} is too large", r.str()));
+    }
+    Value acc = 1;
+    for (u64 p = (u64)e.value(); p != 0; p >>= 1) {
+      if (p & 1) acc = acc * l;
+      if (p > 1) l = l * l;
+    }
+    return acc;
+  }
+
+  Value fact(const Value& x) const {
+    if (x.negative) {
+      throw std::runtime_error(format("Factorial of negative integer {} is not defined", x.str()));
+    }
+    auto n = x.to_i64();
+    if (!n.has_value() || n.value() > MAX_FACTORIAL) {
+      throw std::runtime_error(format("{}! is too large to compute", x.str()));
+    }
+    Value acc = 1;
+    for (u32 i = 2; i <= n.value(); i++) BigInt::mul_add_small(acc.mag, i, 0);
+    return acc;
+  }
+
+  string str(const Value& x) const { return x.str(); }
+  u64 hash(const Value& x) const { return x.hash(); }
+};
+
+// IEEE double precision. Nothing here throws: division by zero, overflow and
+// poles produce inf/nan as IEEE specifies, so the operations stay plain
+// arithmetic that the compiler can inline and vectorize.
+struct F64Arith {
+  using Value = f64;
+  static constexpr bool EXACT = false;
+
+  // Above this, x^n by squaring accumulates more rounding error than std::pow
+  static constexpr f64 MAX_INT_EXPONENT = 64;
+
+  // 170! is the largest factorial representable as a double
+  static constexpr std::array<f64, 171> FACTORIALS = [] {
+    std::array<f64, 171> res{};
+    res[0] = 1;
+    for (usize i = 1; i < res.size(); i++) res[i] = res[i - 1] * (f64)i;
+    return res;
+  }();
+
+  // Decimal literals with optional fraction and exponent, e.g. 1_000.5e-3
+  Value literal(string_view text) const {
+    string digits;
+    for (char c: text) {
+      if (c != '_') digits += c;
+    }
+    f64 res = 0;
+    auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), res);
+    if (ec == std::errc::invalid_argument || end != digits.data() + digits.size()) {
+      throw std::runtime_error(format("Invalid floating point literal \"{}\"", text));
+    }
+    // out of range literals round to inf or 0 like any other IEEE operation
+    if (ec == std::errc::result_out_of_range) return std::strtod(digits.c_str(), nullptr);
+    return res;
+  }
+  Value pos(Value x) const noexcept { return x; }
+  Value neg(Value x) const noexcept { return -x; }
+  Value add(Value l, Value r) const noexcept { return l + r; }
+  Value sub(Value l, Value r) const noexcept { return l - r; }
+  Value mul(Value l, Value r) const noexcept { return l * r; }
+  Value div(Value l, Value r) const noexcept { return l / r; }
+
+  Value pow(Value l, Value r) const noexcept {
+    // Small integral exponents (x^2, x^-3, ...) by squaring, several times
+    // cheaper than the general std::pow
+    if (r == std::trunc(r) && std::fabs(r) <= MAX_INT_EXPONENT) {
+      f64 res = 1;
+      for (u64 p = (u64)std::fabs(r); p != 0; p >>= 1) {
+        if (p & 1) res *= l;
+        l *= l;
+      }
+      return r < 0 ? 1 / res : res;
+    }
+    return std::pow(l, r);
+  }
+
+  // Gamma function extension: x! = tgamma(x + 1), with a table for integers
+  Value fact(Value x) const noexcept {
+    if (x >= 0 && x < FACTORIALS.size() && x == std::trunc(x)) return FACTORIALS[(usize)x];
+    return std::tgamma(x + 1);
+  }
+
+  string str(Value x) const { return format("{}", x); }
+  u64 hash(Value x) const { return std::bit_cast<u64>(x); }
+};
+
+// Exact rationals. Numerator and denominator live in i64 until an operation
+// overflows, after which the value moves to BigInt. Small values are not kept
+// in lowest terms: fractions are only reduced (with a binary GCD) when an
+// operation overflows, and once more for printing, so the common case costs
+// a few checked multiplies and no division.
+struct Rational {
+  i64 num = 0;
+  i64 den = 1; // always positive
+  // Set once the value no longer fits in i64s, in lowest terms; num/den are then unused
+  std::shared_ptr<const pair<BigInt, BigInt>> big;
+
+  bool is_big() const { return big != nullptr; }
+};
+
+struct RationalArith {
+  using Value = Rational;
+  static constexpr bool EXACT = true;
+  using Big = pair<BigInt, BigInt>;
+
+  // Literals like 1e100000 would otherwise allocate without bound
+  static constexpr i64 MAX_LITERAL_EXPONENT = 10'000;
+
+  static u64 gcd(u64 a, u64 b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    int shift = __builtin_ctzll(a | b);
+    a >>= __builtin_ctzll(a);
+    while (b != 0) {
+      b >>= __builtin_ctzll(b);
+      if (a > b) std::swap(a, b);
+      b -= a;
+    }
+    return a << shift;
+  }
+
+  static BigInt gcd(BigInt a, BigInt b) {
+    while (!b.is_zero()) {
+      a = a % b;
+      std::swap(a, b);
+    }
+    a.negative = false;
+    return a;
+  }
+
+  static Value reduce(Value x) {
+    if (x.is_big()) return x;
+    u64 g = gcd(x.num < 0 ? -(u64)x.num : (u64)x.num, (u64)x.den);
+    if (g > 1) {
+      x.num /= (i64)g;
+      x.den /= (i64)g;
+    }
+    return x;
+  }
+
+  static Big to_big(const Value& x) {
+    if (x.is_big()) return *x.big;
+    return {x.num, x.den};
+  }
+
+  // Normalizes sign and reduces to lowest terms, demoting back to i64 when it fits
+  static Value make(BigInt num, BigInt den) {
+    if (den.is_zero()) throw std::runtime_error("Division by zero");
+    if (den.negative) {
+      num = -num;
+      den = -den;
+    }
+    BigInt g = gcd(num, den);
+    if (g != BigInt(1)) {
+      num = num / g;
+      den = den / g;
+    }
+    auto n = num.to_i64(), d = den.to_i64();
+    if (n.has_value() && d.has_value()) return {n.value(), d.value()};
+    return {0, 1, std::make_shared<Big>(std::move(num), std::move(den))};
+  }
+
+  // Tries `small` on the i64 forms, then again after reducing them, and only
+  // then falls back to `big` on BigInts
+  template <typename Small, typename Large>
+  static Value checked(const Value& l, const Value& r, Small small, Large big) {
+    if (!l.is_big() && !r.is_big()) {
+      if (auto res = small(l, r)) return res.value();
+      if (auto res = small(reduce(l), reduce(r))) return res.value();
+    }
+    return big(to_big(l), to_big(r));
+  }
+
+  // digits[.digits][e[+|-]digits], read exactly: 1.25 is 5/4
+  Value literal(string_view text) const {
+    string digits;
+    i64 scale = 0;
+    bool fraction = false;
+    usize i = 0;
+    for (; i < text.size() && text[i] != 'e' && text[i] != 'E'; i++) {
+      char c = text[i];
+      if (c == '_') continue;
+      if (c == '.' && !fraction) {
+        fraction = true;
+        continue;
+      }
+      if (c < '0' || c > '9') throw std::runtime_error(format("Invalid rational literal \"{}\"", text));
+      digits += c;
+      if (fraction) scale--;
+    }
+    if (i < text.size()) {
+      string_view exp = text.substr(i + 1);
+      if (!exp.empty() && exp[0] == '+') exp.remove_prefix(1);
+      i64 e = 0;
+      auto [end, ec] = std::from_chars(exp.data(), exp.data() + exp.size(), e);
+      if (ec != std::errc{} || end != exp.data() + exp.size()) {
+        throw std::runtime_error(format("Invalid rational literal \"{}\"", text));
+      }
+      if (std::abs(e) > MAX_LITERAL_EXPONENT) {
+        throw std::runtime_error(format("Exponent of literal {} is too large", text));
+      }
+      scale += e;
+    }
+    auto num = BigInt::parse(digits);
+    if (!num.has_value()) throw std::runtime_error(format("Invalid rational literal \"{}\"", text));
+    BigInt pow10 = BigArith{}.pow(10, BigInt(std::abs(scale)));
+    if (scale >= 0) return make(num.value() * pow10, 1);
+    return make(num.value(), pow10);
+  }
+
+  Value pos(const Value& x) const { return x; }
+  Value neg(const Value& x) const {
+    if (x.is_big()) return make(-x.big->first, x.big->second);
+    if (x.num == std::numeric_limits<i64>::min()) return make(-BigInt(x.num), x.den);
+    return {-x.num, x.den};
+  }
+
+  Value add(const Value& l, const Value& r) const {
+    return checked(l, r, [](const Value& a, const Value& b) -> optional<Value> {
+      Value res;
+      if (a.den == b.den) {
+        if (__builtin_add_overflow(a.num, b.num, &res.num)) return {};
+        res.den = a.den;
+        return res;
+      }
+      i64 x, y;
+      if (__builtin_mul_overflow(a.num, b.den, &x) || __builtin_mul_overflow(b.num, a.den, &y) ||
+          __builtin_add_overflow(x, y, &res.num) || __builtin_mul_overflow(a.den, b.den, &res.den)) return {};
+      return res;
+    }, [](const Big& a, const Big& b) {
+      return make(a.first * b.second + b.first * a.second, a.second * b.second);
+    });
+  }
+
+  Value sub(const Value& l, const Value& r) const { return add(l, neg(r)); }
+
+  Value mul(const Value& l, const Value& r) const {
+    return checked(l, r, [](const Value& a, const Value& b) -> optional<Value> {
+      Value res;
+      if (__builtin_mul_overflow(a.num, b.num, &res.num) || __builtin_mul_overflow(a.den, b.den, &res.den)) return {};
+      return res;
+    }, [](const Big& a, const Big& b) {
+      return make(a.first * b.first, a.second * b.second);
+    });
+  }
+
+  Value div(const Value& l, const Value& r) const {
+    if (!r.is_big() && r.num == 0) throw std::runtime_error("Division by zero");
+    return checked(l, r, [](const Value& a, const Value& b) -> optional<Value> {
+      Value res;
+      if (__builtin_mul_overflow(a.num, b.den, &res.num) || __builtin_mul_overflow(a.den, b.num, &res.den)) return {};
+      if (res.den < 0) {
+        if (__builtin_sub_overflow(0, res.num, &res.num) || __builtin_sub_overflow(0, res.den, &res.den)) return {};
+      }
+      return res;
+    }, [](const Big& a, const Big& b) {
+      return make(a.first * b.second, a.second * b.first);
+    });
+  }
+
+  Value pow(Value l, const Value& r) const {
+    Value e = reduce(r);
+    if (e.is_big()) {
+      throw std::runtime_error(format("Exponent {} is too large", str(e)));
+    }
+    if (e.den != 1) throw std::runtime_error(format("{}^({}) is not rational", str(l), str(e)));
+    u64 n = e.num < 0 ? -(u64)e.num : (u64)e.num;
+    // the larger of the numerator and denominator is raised to n either way
+    Value base = reduce(l);
+    usize bits = base.is_big() ? std::max(base.big->first.bits(), base.big->second.bits())
+                               : std::bit_width(std::max(base.num < 0 ? -(u64)base.num : (u64)base.num, (u64)base.den));
+    if (BigArith::power_too_large(bits, n)) {
+      throw std::runtime_error(format("Exponent {} is too large", str(e)));
+    }
+    Value acc = {1, 1};
+    for (u64 p = n; p != 0; p >>= 1) {
+      if (p & 1) acc = mul(acc, l);
+      if (p > 1) l = mul(l, l);
+    }
+    return e.num < 0 ? div({1, 1}, acc) : acc;
+  }
+
+  Value fact(const Value& x) const {
+    Value n = reduce(x);
+    if (n.is_big() || n.den != 1) {
+      throw std::runtime_error(format("Factorial of {} is not defined over the rationals", str(n)));
+    }
+    if (n.num <= 20) return {factorial(n.num), 1};
+    return make(BigArith{}.fact(n.num), 1);
+  }
+
+  string str(const Value& x) const {
+    if (x.is_big()) {
+      if (x.big->second == BigInt(1)) return x.big->first.str();
+      return format("{}/{}", x.big->first.str(), x.big->second.str());
+    }
+    Value r = reduce(x);
+    if (r.den == 1) return format("{}", r.num);
+    return format("{}/{}", r.num, r.den);
+  }
+
+  // Of lowest terms, which are unique: a value is only big if it does not fit in i64s
+  u64 hash(const Value& x) const {
+    if (x.is_big()) return hash_mix(x.big->first.hash(), x.big->second.hash());
+    Value r = reduce(x);
+    return hash_mix((u64)r.num, (u64)r.den);
+  }
+};
+
+// An element of Z/p, and the non-negative integer it was computed from while
+// that is known and fits in 64 bits: literals, and sums, products and powers
+// of them. The exponent of ^ is an integer rather than an element of Z/p
+// (2^7 mod 5 is not 2^2), so only that is read from `integer`.
+struct ModValue {
+  u64 residue;
+  u64 integer;
+  bool exact;
+};
+
+// Arithmetic in Z/p. For odd p residues are kept in Montgomery form (x*2^64 mod p),
+// so a product costs three multiplies and no division. Even moduli have no
+// Montgomery representation and fall back to a 128-bit `%`.
+struct ModArith {
+  using Value = ModValue;
+  static constexpr bool EXACT = true;
+
+  u64 p;
+  bool montgomery;
+  u64 p_inv = 0; // p^-1 mod 2^64
+  u64 r1 = 1;    // 2^64 mod p, i.e. 1 in Montgomery form
+  u64 r2 = 0;    // 2^128 mod p, used to convert into Montgomery form
+
+  // Above this, x! mod p is computed with a linear loop that takes seconds
+  static constexpr u64 MAX_FACTORIAL = u64(1) << 30;
+
+  ModArith(u64 p): p(p), montgomery(p % 2 == 1) {
+    if (p == 0) throw std::runtime_error("Modulus must be positive");
+    if (!montgomery) return;
+    // Newton iteration: each step doubles the number of correct low bits,
+    // starting from 3 (p*p == 1 mod 8 for odd p)
+    p_inv = p;
+    for (int i = 0; i < 5; i++) p_inv *= 2 - p * p_inv;
+    r1 = (u64)(((u128)1 << 64) % p);
+    r2 = (u64)((u128)r1 * r1 % p);
+  }
+
+  // Montgomery reduction: t * 2^-64 mod p, for t < p * 2^64
+  u64 redc(u128 t) const {
+    u64 m = (u64)t * p_inv;
+    u64 hi = (u64)(t >> 64);
+    u64 mp = (u64)(((u128)m * p) >> 64);
+    // low words of t and m*p are equal by construction, so they cancel exactly
+    return hi >= mp ? hi - mp : hi - mp + p;
+  }
+
+  u64 enter(u64 x) const { return montgomery ? redc((u128)(x % p) * r2) : x % p; }
+  u64 leave(u64 x) const { return montgomery ? redc(x) : x; }
+
+  Value exact(u64 n) const { return {enter(n), n, true}; }
+  static Value inexact(u64 residue) { return {residue, 0, false}; }
+
+  // The integer x stands for, as an exponent
+  optional<u64> integer(const Value& x) const {
+    if (!x.exact) return {};
+    return x.integer;
+  }
+
+  // Reduced digit by digit, so literals of any length are accepted
+  Value literal(string_view text) const {
+    u64 acc = 0, n = 0;
+    bool exact = true;
+    for (u8 c: text) {
+      if (c == '_') continue;
+      if (c < '0' || c > '9') throw std::runtime_error(format("Invalid integer literal \"{}\"", text));
+      acc = (u64)(((u128)acc * 10 + (c - '0')) % p);
+      exact = exact && !__builtin_mul_overflow(n, 10, &n) && !__builtin_add_overflow(n, c - '0', &n);
+    }
+    return {enter(acc), n, exact};
+  }
+
+  u64 add_residue(u64 l, u64 r) const {
+    u64 s = l + r;
+    return (s < l || s >= p) ? s - p : s;
+  }
+  u64 mul_residue(u64 l, u64 r) const {
+    return montgomery ? redc((u128)l * r) : (u64)((u128)l * r % p);
+  }
+
+  Value pos(Value x) const { return x; }
+  Value neg(Value x) const {
+    if (x.exact && x.integer == 0) return x;
+    return inexact(x.residue == 0 ? 0 : p - x.residue);
+  }
+  Value add(Value l, Value r) const {
+    Value res = {add_residue(l.residue, r.residue), 0, l.exact && r.exact};
+    res.exact = res.exact && !__builtin_add_overflow(l.integer, r.integer, &res.integer);
+    return res;
+  }
+  Value sub(Value l, Value r) const {
+    Value res = {l.residue >= r.residue ? l.residue - r.residue : l.residue - r.residue + p, 0, false};
+    if (l.exact && r.exact && l.integer >= r.integer) {
+      res.integer = l.integer - r.integer;
+      res.exact = true;
+    }
+    return res;
+  }
+  Value mul(Value l, Value r) const {
+    Value res = {mul_residue(l.residue, r.residue), 0, l.exact && r.exact};
+    res.exact = res.exact && !__builtin_mul_overflow(l.integer, r.integer, &res.integer);
+    return res;
+  }
+
+  u64 inverse(u64 a) const {
+    // extended Euclid, tracking only the coefficient of a
+    i128 t = 0, new_t = 1;
+    u64 r = p, new_r = a % p;
+    while (new_r != 0) {
+      u64 q = r / new_r;
+      std::tie(t, new_t) = pair{new_t, t - (i128)q * new_t};
+      std::tie(r, new_r) = pair{new_r, r - q * new_r};
+    }
+    if (r != 1) throw std::runtime_error(format("{} has no inverse modulo {}", a % p, p));
+    return (u64)(t < 0 ? t + p : t);
+  }
+
+  Value div(Value l, Value r) const {
+    Value res = inexact(mul_residue(l.residue, enter(inverse(leave(r.residue)))));
+    // an exact quotient is the integer whose product with r is l
+    if (l.exact && r.exact && r.integer != 0 && l.integer % r.integer == 0) {
+      res.integer = l.integer / r.integer;
+      res.exact = true;
+    }
+    return res;
+  }
+
+  // The exponent must be known as an integer: reducing it modulo p, or modulo
+  // phi(p) for that matter, changes the result
+  Value pow(Value l, Value r) const {
+    auto e = integer(r);
+    if (!e.has_value()) {
+      throw std::runtime_error(format("Exponent is only known modulo {}, as {}", p, str(r)));
+    }
+    Value acc = exact(1);
+    for (u64 n = e.value(); n != 0; n >>= 1) {
+      if (n & 1) acc = mul(acc, l);
+      if (n > 1) l = mul(l, l);
+    }
+    return acc;
+  }
+
+  Value fact(Value x) const {
+    u64 n = leave(x.residue);
+    if (x.exact && x.integer <= 20) return exact(factorial((i64)x.integer));
+    // p divides n! for every n >= p
+    if (x.exact && x.integer >= p) return inexact(0);
+    if (n > MAX_FACTORIAL) throw std::runtime_error(format("{}! mod {} is too large to compute", n, p));
+    u64 one = enter(1), term = 0, acc = one;
+    for (u64 i = 1; i <= n; i++) {
+      term = add_residue(term, one);
+      acc = mul_residue(acc, term);
+    }
+    return inexact(acc);
+  }
+
+  string str(Value x) const { return format("{}", leave(x.residue)); }
+  // 5 and 2 are the same residue mod 3 but not the same exponent
+  u64 hash(Value x) const { return hash_mix(hash_mix(x.residue, x.exact), x.exact ? x.integer : 0); }
+
+  // + and * in Z/p are associative, so chains reduce their residues in four
+  // independent accumulators and the multiplies or adds can overlap. The
+  // integers are only followed while every operand has one.
+  Value sum(Value acc, std::span<Value> values) const {
+    u64 s[4] = {acc.residue, 0, 0, 0};
+    usize i = 0;
+    for (; i + 4 <= values.size(); i += 4) {
+      for (usize k = 0; k < 4; k++) s[k] = add_residue(s[k], values[i + k].residue);
+    }
+    for (; i < values.size(); i++) s[0] = add_residue(s[0], values[i].residue);
+    Value res = {add_residue(add_residue(s[0], s[1]), add_residue(s[2], s[3])), acc.integer, acc.exact};
+    for (usize k = 0; k < values.size() && res.exact; k++) {
+      res.exact = values[k].exact && !__builtin_add_overflow(res.integer, values[k].integer, &res.integer);
+    }
+    return res;
+  }
+
+  Value product(Value acc, std::span<Value> values) const {
+    u64 one = enter(1);
+    u64 p[4] = {acc.residue, one, one, one};
+    usize i = 0;
+    for (; i + 4 <= values.size(); i += 4) {
+      for (usize k = 0; k < 4; k++) p[k] = mul_residue(p[k], values[i + k].residue);
+    }
+    for (; i < values.size(); i++) p[0] = mul_residue(p[0], values[i].residue);
+    Value res = {mul_residue(mul_residue(p[0], p[1]), mul_residue(p[2], p[3])), acc.integer, acc.exact};
+    for (usize k = 0; k < values.size() && res.exact; k++) {
+      res.exact = values[k].exact && !__builtin_mul_overflow(res.integer, values[k].integer, &res.integer);
+    }
+    return res;
+  }
+};
+//== end numeric backends }}}
 
 using BindingPower = optional<pair<u8,u8>>;
 
@@ -93,9 +1027,17 @@ struct Op {
 
   Kind kind;
 
-  Op(Kind kind): kind(kind) {}
+  constexpr Op(Kind kind): kind(kind) {}
 
-  BindingPower infix_binding_power() const {
+  // The operator written as c, if there is one
+  static constexpr optional<Kind> from_symbol(u8 c) {
+    #define X(op, sym, _0, _1, _2) if (c == (#sym)[0]) return Kind::op;
+    OP_LIST
+    #undef X
+    return {};
+  }
+
+  constexpr BindingPower infix_binding_power() const {
     #define X(op, _0, bp, _1, _2) case Kind::op: return {bp}; 
     switch(kind) {
       OP_LIST
@@ -103,7 +1045,7 @@ struct Op {
     #undef X
   }
 
-  BindingPower prefix_binding_power() const {
+  constexpr BindingPower prefix_binding_power() const {
     #define X(op, _0, _1, bp, _2) case Kind::op: return {bp}; 
     switch(kind) {
       OP_LIST
@@ -111,7 +1053,7 @@ struct Op {
     #undef X
   }
 
-  BindingPower postfix_binding_power() const {
+  constexpr BindingPower postfix_binding_power() const {
     #define X(op, _0, _1, _2, bp) case Kind::op: return {bp};
     switch(kind) {
       OP_LIST
@@ -135,26 +1077,63 @@ struct Op {
     #undef X
   }
 
-  i64 eval(i64 x) const {
+  template <typename N>
+  typename N::Value eval(const N& num, typename N::Value x) const {
     switch(this->kind) {
-      case Kind::Add: return x;
-      case Kind::Sub: return -x;
-      case Kind::Fact: return factorial(x);
+      case Kind::Add: return num.pos(x);
+      case Kind::Sub: return num.neg(x);
+      case Kind::Fact: return num.fact(x);
       default: throw std::runtime_error(format("Invalid unary operator '{}'. This should be unreachable.", this->symbol()));
     }
   }
 
-  i64 eval(i64 left, i64 right) const {
+  template <typename N>
+  typename N::Value eval(const N& num, typename N::Value left, typename N::Value right) const {
     switch(this->kind){
-      case Kind::Add:  return left + right;
-      case Kind::Sub:  return left - right;
-      case Kind::Mul:  return left * right;
-      case Kind::Div:  return left / right;
-      case Kind::Exp:  return powi(left, right);
+      case Kind::Add:  return num.add(left, right);
+      case Kind::Sub:  return num.sub(left, right);
+      case Kind::Mul:  return num.mul(left, right);
+      case Kind::Div:  return num.div(left, right);
+      case Kind::Exp:  return num.pow(left, right);
       default: throw std::runtime_error(format("Invalid infix operator '{}'. This should be unreachable", this->symbol()));
     }
 
   }
+
+  // acc op values[0] op values[1] ..., grouped left to right. Backends can
+  // supply a faster sum/product, which must give the same result and raise
+  // the same error as the left to right loop.
+  template <typename N>
+  typename N::Value reduce(const N& num, typename N::Value acc, std::span<typename N::Value> values) const {
+    usize step;
+    return reduce(num, std::move(acc), values, step);
+  }
+
+  // Same, and if a step throws, step is the index in values of the operand it applied
+  template <typename N>
+  typename N::Value reduce(const N& num, typename N::Value acc, std::span<typename N::Value> values, usize& step) const {
+    step = 0;
+    // the fast paths do not say which step failed, so after an error the
+    // block is redone a step at a time, from copies of its words
+    if constexpr (requires { num.sum(acc, values); }) {
+      static_assert(std::is_trivially_copyable_v<typename N::Value>);
+      if (kind == Kind::Add) {
+        try {
+          return num.sum(acc, values);
+        } catch (const std::runtime_error&) {}
+      }
+    }
+    if constexpr (requires { num.product(acc, values); }) {
+      static_assert(std::is_trivially_copyable_v<typename N::Value>);
+      if (kind == Kind::Mul) {
+        try {
+          return num.product(acc, values);
+        } catch (const std::runtime_error&) {}
+      }
+    }
+    for (; step < values.size(); step++) acc = eval(num, std::move(acc), std::move(values[step]));
+    return acc;
+  }
 };
 #undef INFIX
 #undef PREFIX
@@ -166,19 +1145,24 @@ struct Op {
 
 struct Token {
   enum class Kind  {
-    None, Int, Op, LParen, RParen,
+    None, Num, Ident, Op, LParen, RParen,
   };
   const Kind kind;
   union {
     const u8 byte;
-    const i64 integer;
+    // Num: the literal as written. The numeric backend decides how to read it.
+    // Ident: the variable name.
+    const string_view text;
     const Op op;
   };
+  // Byte offset of the token in the source, for error messages
+  usize offset = 0;
+
   Token(): kind(Kind::None), byte('\0') {}
   Token(u8 byte): 
       kind(byte == ')' ? Kind::RParen : byte == '(' ? Kind::LParen : Kind::None),
       byte(byte) {}
-  Token(i64 integer): kind(Kind::Int), integer(integer) {}
+  Token(string_view text, Kind kind = Kind::Num): kind(kind), text(text) {}
   Token(Op::Kind op): kind(Kind::Op), op(op) {}
 
 
@@ -186,7 +1170,8 @@ struct Token {
   static std::string name(Token::Kind kind) {
     switch(kind) {
       case(Token::Kind::None): return "<None>";
-      case(Token::Kind::Int): return "Int";
+      case(Token::Kind::Num): return "Num";
+      case(Token::Kind::Ident): return "Ident";
       case(Token::Kind::Op): return "Op";
       case(Token::Kind::LParen): return "LParen";
       case(Token::Kind::RParen): return "RParen";
@@ -196,7 +1181,8 @@ struct Token {
   string str() const {
     switch(kind) {
       case Kind::Op: return format("{}: {}", Token::name(kind), op.symbol());
-      case Kind::Int: return format("{}: {}", Token::name(kind), integer);
+      case Kind::Num:
+      case Kind::Ident: return format("{}: {}", Token::name(kind), text);
       default: return format("{}: '{:c}'", Token::name(kind), byte);
     }
   }
@@ -204,24 +1190,36 @@ struct Token {
 
 ////== end token definition }}}
 
-bool is_space(u8 c) {
+constexpr bool is_space(u8 c) {
   return c == ' ' || c == '\n' || c == '\r' || c == '\t';
 }
 
-bool is_digit(u8 c) {
+constexpr bool is_digit(u8 c) {
   return c >= '0' && c <= '9';
 }
 
-bool is_hexdigit(u8 c) {
-  return (c >= '0' && c <= '9') || (c >= 'a' || c <= 'f') || (c >= 'A' || c <= 'F');
+constexpr bool is_ident_start(u8 c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool is_ident(u8 c) {
+  return is_ident_start(c) || is_digit(c);
+}
+
+bool is_hexdigit(u8 c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' || c <= 'f') || (c >= 'A' || c <= 'F');
 }
 
 struct Tokenizer {
-  std::vector<u8> stream;
+  // Borrowed, not copied: it must outlive the tokenizer and the tokens, whose
+  // lexemes point into it
+  std::span<const u8> stream;
   usize index = 0;
+  // Offset of `stream` within the whole input, when it is one window of a larger one
+  usize base = 0;
 
-  Tokenizer(string s): stream(s.begin(), s.end()) {}
-  Tokenizer(vector<u8> stream): stream(stream) {}
+  Tokenizer(string_view s): stream((const u8*)s.data(), s.size()) {}
+  Tokenizer(std::span<const u8> stream): stream(stream) {}
 
   u8 peek(i64 n = 0) {
     if (index + n >= stream.size()) {
@@ -239,23 +1237,55 @@ struct Tokenizer {
     return c;
   };
 
-  Token read_number() {
+  void read_digits() {
     u8 c = '\0';
-    i64 acc = 0;
     while (is_digit(c = peek()) || c == '_') {
       index++;
-      if (c == '_') continue;
-      acc = 10 * acc + (c - '0');
     }
-    return acc;
   }
 
+  // digits[.digits][(e|E)[+|-]digits]. Which of these forms are valid is up
+  // to the numeric backend.
+  Token read_number() {
+    usize start = index;
+    read_digits();
+    if (peek() == '.' && is_digit(peek(1))) {
+      index++;
+      read_digits();
+    }
+    if (peek() == 'e' || peek() == 'E') {
+      usize sign = (peek(1) == '+' || peek(1) == '-') ? 1 : 0;
+      if (is_digit(peek(1 + sign))) {
+        index += 1 + sign;
+        read_digits();
+      }
+    }
+    return string_view((const char*)stream.data() + start, index - start);
+  }
+
+  Token read_ident() {
+    usize start = index;
+    while (is_ident(peek())) {
+      index++;
+    }
+    return {string_view((const char*)stream.data() + start, index - start), Token::Kind::Ident};
+  }
+
+  // Returns a None token at the end of the stream
   Token next() {
     // Consume whitespace
     while (is_space(peek())) {
       index++;
     }
 
+    usize start = index;
+    Token tok = read_token();
+    tok.offset = base + start;
+    return tok;
+  }
+
+  Token read_token() {
+    if (index >= stream.size()) return {};
     u8 c = peek();
 
     #define X(op, sym, _0, _1, _2) case (#sym)[0]: { index++; return Op::Kind::op; }
@@ -267,17 +1297,24 @@ struct Tokenizer {
       OP_LIST
       default:
         if (is_digit(c)) return read_number();
+        if (is_ident_start(c)) return read_ident();
         // Unclassifiable -- abort
-        Token tok = c;
-        throw std::runtime_error(format("Unexpected token {} at byte {} of stream", tok.str(), index));
+        throw unexpected(c, base + index);
     }
     #undef X
   }
 
+  static std::runtime_error unexpected(u8 c, usize offset) {
+    Token tok = c;
+    return std::runtime_error(format("Unexpected token {} at byte {} of stream", tok.str(), offset));
+  }
+
   vector<Token> tokenize() {
     vector<Token> tokens{};
-    while (index < stream.size()) {
-      tokens.emplace_back(next());
+    while (true) {
+      Token tok = next();
+      if (tok.kind == Token::Kind::None) break;
+      tokens.emplace_back(tok);
     }
     return tokens;
   }
@@ -287,16 +1324,97 @@ struct Tokenizer {
 //== Parser ===== {{{
 
 ////== Expr definition ===== {{{
+// No place in the source, for nodes that the parser did not build
+constexpr usize NOWHERE = std::numeric_limits<usize>::max();
+
+// Rethrows the exception being handled, naming the byte offset of the
+// operator that raised it if there is one
+[[noreturn]] inline void rethrow_at(usize offset) {
+  if (offset == NOWHERE) throw;
+  try {
+    throw;
+  } catch (const std::runtime_error& e) {
+    throw std::runtime_error(format("{} at byte {}", e.what(), offset));
+  }
+}
+
+// Evaluates operand(0) op operand(1) op ... op operand(count - 1) a block at
+// a time into a buffer, and reduces each block with Op::reduce. Results and
+// errors are those of the equivalent left-deep binary tree: a step that
+// fails names offsets[i], the operator before operand(i), if there is one.
+//
+// Machine words go in a local array. Values that need construction, like
+// BigInt, go in a per-thread stack of blocks instead: each chain takes the
+// block above those of the chains it is nested in, so the values are built
+// once per thread and nesting depth rather than on every call.
+template <typename N, typename Operand>
+typename N::Value eval_chain(const N& num, Op op, usize count, Operand&& operand, std::span<const usize> offsets) {
+  using Value = typename N::Value;
+  static constexpr usize BLOCK = 64;
+  Value acc = operand(0);
+  // block(k) may move when a nested chain grows the stack, so it is looked up each time
+  auto run = [&](auto&& block) {
+    for (usize i = 1; i < count;) {
+      usize n = 0;
+      std::exception_ptr failed;
+      for (; n < BLOCK && i < count; n++, i++) {
+        try {
+          Value x = operand(i);
+          block(n) = std::move(x);
+        } catch (...) {
+          failed = std::current_exception();
+          break;
+        }
+      }
+      // the binary tree applies the operator to everything before a failing
+      // operand first, so an error from that takes precedence
+      usize start = i - n, step = 0;
+      try {
+        acc = op.reduce(num, std::move(acc), std::span<Value>(&block(0), n), step);
+      } catch (...) {
+        rethrow_at(start + step < offsets.size() ? offsets[start + step] : NOWHERE);
+      }
+      if (failed) std::rethrow_exception(failed);
+    }
+  };
+  if constexpr (std::is_trivially_default_constructible_v<Value>) {
+    Value block[BLOCK];
+    run([&](usize k) -> Value& { return block[k]; });
+  } else {
+    static thread_local vector<Value> stack;
+    static thread_local usize top = 0;
+    struct Frame {
+      usize base;
+      Frame(): base(top) {
+        top += BLOCK;
+        if (stack.size() < top) stack.resize(top);
+      }
+      ~Frame() { top = base; }
+    } frame;
+    run([&](usize k) -> Value& { return stack[frame.base + k]; });
+  }
+  return acc;
+}
+
+template <typename N>
 struct Expr{
+  using Value = typename N::Value;
+
   enum class Kind {
     None,
     Literal,
+    Variable,
     Unary,
     Binary,
-  } kind = kind = Kind::None;
+    Nary,
+  } kind = Kind::None;
 
   union {
-    i64 literal;
+    Value literal;
+    struct {
+      usize slot; // index into the bindings passed to eval
+      string name;
+    } var;
     struct {
       Op op;
       unique_ptr<Expr> expr;
@@ -306,14 +1424,29 @@ struct Expr{
       unique_ptr<Expr> left;
       unique_ptr<Expr> right;
     } binary;
+    // A left to right chain of + or *, ((a op b) op c) op ..., with its
+    // operands stored contiguously
+    struct {
+      Op op;
+      vector<unique_ptr<Expr>> operands;
+      // by operand, the byte offset of the operator before it, or empty
+      vector<usize> offsets;
+    } nary;
   };
 
-  string str();
+  // Unary and Binary: byte offset of the operator, for errors
+  usize offset = NOWHERE;
 
-  friend std::ostream& operator<< (std::ostream &os, const Expr& expr);
+  string str(const N& num);
 
   Expr(): kind(Kind::None) {};
-  Expr(i64 val): kind(Kind::Literal), literal(val) {}
+  Expr(Value val): kind(Kind::Literal) {
+    new (&literal) Value(std::move(val));
+  }
+  Expr(usize slot, string name): kind(Kind::Variable) {
+    var.slot = slot;
+    new (&var.name) string(std::move(name));
+  }
   Expr(Op op, unique_ptr<Expr> expr): kind(Kind::Unary) {
     unary.op = op;
     new (&unary.expr) unique_ptr<Expr>(std::move(expr));
@@ -323,47 +1456,219 @@ struct Expr{
     new (&binary.left) unique_ptr<Expr>(std::move(left));
     new (&binary.right) unique_ptr<Expr>(std::move(right));
   }
+  Expr(Op op, vector<unique_ptr<Expr>> operands, vector<usize> offsets = {}): kind(Kind::Nary) {
+    nary.op = op;
+    new (&nary.operands) vector<unique_ptr<Expr>>(std::move(operands));
+    new (&nary.offsets) vector<usize>(std::move(offsets));
+  }
   ~Expr() {
     switch(kind) {
       case Kind::None:
+        break;
       case Kind::Literal:
+        literal.~Value();
+        break;
+      case Kind::Variable:
+        var.name.~string();
         break;
       case Kind::Unary:
         unary.expr.~unique_ptr<Expr>();
+        break;
       case Kind::Binary:
         binary.left.~unique_ptr<Expr>();
         binary.right.~unique_ptr<Expr>();
         break;
+      case Kind::Nary:
+        nary.operands.~vector<unique_ptr<Expr>>();
+        nary.offsets.~vector<usize>();
+        break;
     }
   }
   
-  static unique_ptr<Expr> Literal(i64 val) {
-    return make_unique<Expr>(val);
+  static unique_ptr<Expr> Literal(Value val) {
+    return make_unique<Expr>(std::move(val));
+  }
+
+  static unique_ptr<Expr> Variable(usize slot, string name) {
+    return make_unique<Expr>(slot, std::move(name));
+  }
+
+  // A left-to-right chain of op: the operand itself, a Binary or a Nary
+  // node. offsets are as in nary, or empty.
+  static unique_ptr<Expr> Chain(Op op, vector<unique_ptr<Expr>> operands, vector<usize> offsets = {}) {
+    assert(!operands.empty() && (offsets.empty() || offsets.size() == operands.size()));
+    if (operands.size() == 1) return std::move(operands[0]);
+    if (operands.size() == 2) {
+      auto e = make_unique<Expr>(op, std::move(operands[0]), std::move(operands[1]));
+      if (!offsets.empty()) e->offset = offsets[1];
+      return e;
+    }
+    return make_unique<Expr>(op, std::move(operands), std::move(offsets));
+  }
+
+  unique_ptr<Expr> placed(unique_ptr<Expr> e) const {
+    e->offset = this->offset;
+    return e;
+  }
+
+  unique_ptr<Expr> clone() const {
+    switch(this->kind) {
+      case Kind::None: return make_unique<Expr>();
+      case Kind::Literal: return Literal(this->literal);
+      case Kind::Variable: return Variable(this->var.slot, this->var.name);
+      case Kind::Unary: return placed(make_unique<Expr>(this->unary.op, this->unary.expr->clone()));
+      case Kind::Binary: return placed(make_unique<Expr>(this->binary.op, this->binary.left->clone(), this->binary.right->clone()));
+      case Kind::Nary: {
+        vector<unique_ptr<Expr>> operands;
+        for (const auto& e: this->nary.operands) operands.push_back(e->clone());
+        return make_unique<Expr>(this->nary.op, std::move(operands), this->nary.offsets);
+      }
+    }
+    throw std::runtime_error("Invalid expression kind. This should be unreachable.");
+  }
+
+  // Hash of the tree's structure, literal values and variable names. Stable
+  // across runs and platforms, so it can key persistent caches.
+  u64 hash(const N& num) const {
+    switch(this->kind) {
+      case Kind::None:
+      case Kind::Literal:
+      case Kind::Variable: return leaf_hash(num);
+      case Kind::Unary: return unary_hash(this->unary.op, this->unary.expr->hash(num));
+      case Kind::Binary: return binary_hash(this->binary.op, this->binary.left->hash(num), this->binary.right->hash(num));
+      case Kind::Nary: {
+        u64 h = chain_hash(this->nary.op);
+        for (const auto& e: this->nary.operands) h = hash_mix(h, e->hash(num));
+        return h;
+      }
+    }
+    throw std::runtime_error("Invalid expression kind. This should be unreachable.");
+  }
+
+  // The parts of hash, for passes that build it bottom-up as they go
+  u64 leaf_hash(const N& num) const {
+    switch(this->kind) {
+      case Kind::Literal: return hash_mix(1, num.hash(this->literal));
+      case Kind::Variable: return hash_mix(2, hash_bytes(this->var.name));
+      default: return hash_mix(0, 0);
+    }
+  }
+  static u64 unary_hash(Op op, u64 x) { return hash_mix(hash_mix(3, (u64)op.kind), x); }
+  static u64 binary_hash(Op op, u64 l, u64 r) { return hash_mix(hash_mix(hash_mix(4, (u64)op.kind), l), r); }
+  // mixed with each operand's hash in turn
+  static u64 chain_hash(Op op) { return hash_mix(5, (u64)op.kind); }
+
+  // Number of nodes in the tree
+  usize size() const {
+    switch(this->kind) {
+      case Kind::None:
+      case Kind::Literal:
+      case Kind::Variable: return 1;
+      case Kind::Unary: return 1 + this->unary.expr->size();
+      case Kind::Binary: return 1 + this->binary.left->size() + this->binary.right->size();
+      case Kind::Nary: {
+        usize n = 1;
+        for (const auto& e: this->nary.operands) n += e->size();
+        return n;
+      }
+    }
+    throw std::runtime_error("Invalid expression kind. This should be unreachable.");
   }
 
-  i64 eval() {
+  Value eval(const N& num, std::span<const Value> vars = {}) const {
     switch(this->kind) {
       case Kind::None: throw std::runtime_error("Attempt to eval expr of type None");
       case Kind::Literal: return this->literal;
-      case Kind::Unary:   return this->unary.op.eval(this->unary.expr->eval());
-      case Kind::Binary:  return this->binary.op.eval(this->binary.left->eval(), this->binary.right->eval());
+      case Kind::Variable:
+        if (this->var.slot >= vars.size()) throw std::runtime_error(format("Unbound variable '{}'", this->var.name));
+        return vars[this->var.slot];
+      case Kind::Unary: {
+        Value x = this->unary.expr->eval(num, vars);
+        try {
+          return this->unary.op.eval(num, std::move(x));
+        } catch (const std::runtime_error&) {
+          rethrow_at(this->offset);
+        }
+      }
+      case Kind::Binary: {
+        // sequenced explicitly: function argument order is unspecified, and it
+        // decides which error is reported when both operands fail
+        Value left = this->binary.left->eval(num, vars);
+        Value right = this->binary.right->eval(num, vars);
+        try {
+          return this->binary.op.eval(num, std::move(left), std::move(right));
+        } catch (const std::runtime_error&) {
+          rethrow_at(this->offset);
+        }
+      }
+      case Kind::Nary: return eval_nary(num, vars);
     } 
   }
+
+  Value eval_nary(const N& num, std::span<const Value> vars) const {
+    const auto& operands = this->nary.operands;
+    return eval_chain(num, this->nary.op, operands.size(), [&](usize i) { return operands[i]->eval(num, vars); },
+                      this->nary.offsets);
+  }
 };
 
-string Expr::str() {
+template <typename N>
+string Expr<N>::str(const N& num) {
   switch(kind) {
     case Kind::None: return "<none>";
-    case Kind::Literal: return format("{}", literal);
-    case Kind::Unary: return format("({} {})", unary.op.symbol(), unary.expr->str(), literal);
-    case Kind::Binary: return format("({} {} {})", binary.op.symbol(), binary.left->str(), binary.right->str());
+    case Kind::Literal:
+      // in Z/p, the integer as written rather than its residue
+      if constexpr (requires { num.integer(literal); }) {
+        if (auto n = num.integer(literal)) return format("{}", n.value());
+      }
+      return num.str(literal);
+    case Kind::Variable: return var.name;
+    case Kind::Unary: return format("({} {})", unary.op.symbol(), unary.expr->str(num));
+    case Kind::Binary: return format("({} {} {})", binary.op.symbol(), binary.left->str(num), binary.right->str(num));
+    case Kind::Nary: {
+      string res = format("({}", nary.op.symbol());
+      for (const auto& e: nary.operands) res += " " + e->str(num);
+      return res + ")";
+    }
   }
 }
 ////== end expr struct definition }}}
 
+template <typename N>
 struct Parser {
+  using Value = typename N::Value;
+
+  const N& num;
   vector<Token> tokens {};
   i64 index = 0;
+  // Evaluate operators on constant operands while parsing
+  bool fold_constants = false;
+  // Collect chains of + and * into Nary nodes instead of left-deep trees
+  bool flatten_chains = true;
+  // Variable names, in order of first appearance. A variable's slot is its index here.
+  vector<string> variables {};
+  // calls of parse_operand under way
+  usize nesting = 0;
+
+  // The deepest tree, and the most nested brackets and operators, accepted.
+  // Parsing, evaluating and every pass recurse over the tree, so without a
+  // bound one request could overflow the stack.
+  static constexpr usize MAX_DEPTH = 10000;
+
+  // A parsed subexpression. Constants are carried as plain values and only
+  // become Expr nodes once they are attached to a non-constant node, so with
+  // fold_constants a literal-only expression allocates a single node.
+  struct Operand {
+    optional<Value> value;
+    unique_ptr<Expr<N>> expr;
+    // the height of expr
+    usize depth = 0;
+
+    unique_ptr<Expr<N>> node() && {
+      if (value.has_value()) return Expr<N>::Literal(std::move(value.value()));
+      return std::move(expr);
+    }
+  };
   
   Token peek() const {
     if (index >= tokens.size()) return {};
@@ -375,19 +1680,104 @@ struct Parser {
     if (index <= tokens.size()) index++;
     return tok;
   }
+
+  static string where(const Token& tok) {
+    if (tok.kind == Token::Kind::None) return "at end of input";
+    return format("at byte {}", tok.offset);
+  }
+
+  // depth for a node made by the operator tok
+  static usize deeper(const Token& tok, usize depth) {
+    if (depth > MAX_DEPTH) throw std::runtime_error(format("Expression nests more than {} deep {}", MAX_DEPTH, where(tok)));
+    return depth;
+  }
+
+  usize slot(string_view name) {
+    for (usize i = 0; i < variables.size(); i++) {
+      if (variables[i] == name) return i;
+    }
+    variables.emplace_back(name);
+    return variables.size() - 1;
+  }
+
+  // tok is the operator. If evaluating fails the node is kept, so the error
+  // is raised by eval exactly as it would be without folding, at the
+  // operator's offset.
+  Operand apply(const Token& tok, Operand x) {
+    Op op = tok.op;
+    if (fold_constants && x.value.has_value()) {
+      try {
+        return {op.eval(num, x.value.value())};
+      } catch (const std::runtime_error&) {}
+    }
+    usize depth = deeper(tok, x.depth + 1);
+    auto node = make_unique<Expr<N>>(op, std::move(x).node());
+    node->offset = tok.offset;
+    return {{}, std::move(node), depth};
+  }
+
+  Operand apply(const Token& tok, Operand l, Operand r) {
+    Op op = tok.op;
+    if (fold_constants && l.value.has_value() && r.value.has_value()) {
+      try {
+        return {op.eval(num, l.value.value(), r.value.value())};
+      } catch (const std::runtime_error&) {}
+    }
+    auto lhs = std::move(l).node();
+    using E = Expr<N>;
+    if (flatten_chains && (op.kind == Op::Kind::Add || op.kind == Op::Kind::Mul)) {
+      // the Pratt loop reduces left to right, so lhs op r extends a chain of op on the left.
+      // The chain gets no taller for it, unless r is taller than its other operands.
+      usize depth = deeper(tok, std::max(l.depth, r.depth + 1));
+      if (lhs->kind == E::Kind::Nary && lhs->nary.op.kind == op.kind) {
+        lhs->nary.operands.push_back(std::move(r).node());
+        lhs->nary.offsets.push_back(tok.offset);
+        return {{}, std::move(lhs), depth};
+      }
+      if (lhs->kind == E::Kind::Binary && lhs->binary.op.kind == op.kind) {
+        vector<unique_ptr<E>> operands;
+        operands.push_back(std::move(lhs->binary.left));
+        operands.push_back(std::move(lhs->binary.right));
+        operands.push_back(std::move(r).node());
+        vector<usize> offsets = {NOWHERE, lhs->offset, tok.offset};
+        return {{}, make_unique<E>(op, std::move(operands), std::move(offsets)), depth};
+      }
+    }
+    usize depth = deeper(tok, std::max(l.depth, r.depth) + 1);
+    auto node = make_unique<E>(op, std::move(lhs), std::move(r).node());
+    node->offset = tok.offset;
+    return {{}, std::move(node), depth};
+  }
+
+  unique_ptr<Expr<N>> parse_expr(u8 min_bp = 0, usize bracket_depth = 0) {
+    return parse_operand(min_bp, bracket_depth).node();
+  }
   
-  unique_ptr<Expr> parse_expr(u8 min_bp = 0, u8 bracket_depth = 0) {
+  Operand parse_operand(u8 min_bp, usize bracket_depth) {
     auto lhs_tok = this->next();
-    unique_ptr<Expr> lhs;
+    Operand lhs;
+    // brackets and operators folded away nest the recursion, but not the tree
+    if (nesting == MAX_DEPTH) throw std::runtime_error(format("Expression nests more than {} deep {}", MAX_DEPTH, where(lhs_tok)));
+    nesting++;
+    struct Leave {
+      usize& nesting;
+      ~Leave() { nesting--; }
+    } leave {nesting};
 
     switch (lhs_tok.kind) {
-      case Token::Kind::Int: {
-        lhs = Expr::Literal(lhs_tok.integer);
+      case Token::Kind::Num: {
+        lhs = {num.literal(lhs_tok.text)};
+        break;
+      }
+      case Token::Kind::Ident: {
+        lhs = {{}, Expr<N>::Variable(slot(lhs_tok.text), string(lhs_tok.text))};
         break;
       }
       case Token::Kind::LParen: {
-        lhs = parse_expr(0, bracket_depth+1);
-        if (next().kind != Token::Kind::RParen) throw std::runtime_error("Expected ')'");
+        lhs = parse_operand(0, bracket_depth+1);
+        if (auto tok = next(); tok.kind != Token::Kind::RParen) {
+          throw std::runtime_error(format("Expected ')' {}", where(tok)));
+        }
         break;
       }
       case Token::Kind::Op: {  
@@ -396,28 +1786,27 @@ struct Parser {
 
         // get binding power and unwrap
         auto bp_opt = op.prefix_binding_power();
-        if (!bp_opt.has_value()) throw std::runtime_error(format("Invalid unary operator '{}'", op.symbol()));
+        if (!bp_opt.has_value()) throw std::runtime_error(format("Invalid unary operator '{}' {}", op.symbol(), where(lhs_tok)));
         auto [_, bp] = bp_opt.value();
 
-        auto rhs = parse_expr(bp);
-        lhs = make_unique<Expr>(op, std::move(rhs));
+        auto rhs = parse_operand(bp, bracket_depth);
+        lhs = apply(lhs_tok, std::move(rhs));
         break;
       }
-      default: throw std::runtime_error(format("Unexpected token \"{}\"", lhs_tok.str()));
+      default: throw std::runtime_error(format("Unexpected token \"{}\" {}", lhs_tok.str(), where(lhs_tok)));
     }
 
     // parse binary operators
     while (true) {
       auto tok = peek();
-      cout << "loop: tok: " << tok.str() << endl;
       if (tok.kind == Token::Kind::None) break; // EOF
       if (tok.kind == Token::Kind::RParen) {
         if (bracket_depth == 0) {
-          throw std::runtime_error("Unbalanced brackets!");
+          throw std::runtime_error(format("Unbalanced brackets {}!", where(tok)));
         }
         break;
       }
-      if (tok.kind != Token::Kind::Op) throw std::runtime_error(format("Expected operator, got \"{}\"!", tok.str()));
+      if (tok.kind != Token::Kind::Op) throw std::runtime_error(format("Expected operator, got \"{}\" {}!", tok.str(), where(tok)));
 
       // token is op
       auto op = tok.op;
@@ -427,7 +1816,7 @@ struct Parser {
         auto [bp, _] = power.value();
         if (bp < min_bp) break;
         next();
-        lhs = make_unique<Expr>(op, std::move(lhs));
+        lhs = apply(tok, std::move(lhs));
       }
 
       // Check for infix operator
@@ -435,8 +1824,8 @@ struct Parser {
         auto [l_bp, r_bp] = op.infix_binding_power().value();
         if (l_bp < min_bp) break;
         next();
-        auto rhs = parse_expr(r_bp);
-        lhs = make_unique<Expr>(op, std::move(lhs), std::move(rhs));
+        auto rhs = parse_operand(r_bp, bracket_depth);
+        lhs = apply(tok, std::move(lhs), std::move(rhs));
       }
     }
     return lhs;
@@ -446,49 +1835,4790 @@ struct Parser {
 
 //== end parser }}}
 
-int main(int argc, char **argv) {
-  // TODO: too much validation at all stages, leading to exceptions peppered throughout
-  // possibly remove things like None from many stages
-  // also, return errors instead of panicking, perhaps
-  
-  if (argc == 1) throw std::runtime_error("No argument!");
+//== Closure compilation ===== {{{
+// Compiles an Expr into a tree of Closures. Each closure holds a pointer to
+// a function that is specialised for its node's kind and operator, so
+// evaluating it skips the switch on the kind and the one in Op::eval. A
+// literal operand of a binary operator is stored in the closure itself and
+// is not a call of its own. Results and errors are the same as Expr::eval.
+template <typename N>
+class Closure {
+  using E = Expr<N>;
+  using Value = typename N::Value;
+  using Fn = Value (*)(const Closure&, const N&, std::span<const Value>);
 
-  string stream = "";
-  bool print_tokens = true;
-  bool print_ast = true;
+public:
+  static Closure compile(const E& e) {
+    Closure c;
+    c.offset = e.offset;
+    switch (e.kind) {
+      case E::Kind::None: c.fn = none; break;
+      case E::Kind::Literal:
+        c.fn = literal;
+        c.value = e.literal;
+        break;
+      case E::Kind::Variable:
+        c.fn = variable;
+        c.slot = e.var.slot;
+        c.name = e.var.name;
+        break;
+      case E::Kind::Unary:
+        c.fn = resolve(e.unary.op, [](auto k) -> Fn { return unary<decltype(k)::value>; });
+        c.operands.push_back(compile(*e.unary.expr));
+        break;
+      case E::Kind::Binary: {
+        const E& l = *e.binary.left;
+        const E& r = *e.binary.right;
+        if (r.kind == E::Kind::Literal) {
+          // x op lit
+          c.fn = resolve(e.binary.op, [](auto k) -> Fn { return binary_literal_right<decltype(k)::value>; });
+          c.value = r.literal;
+          c.operands.push_back(compile(l));
+        } else if (l.kind == E::Kind::Literal) {
+          // lit op x
+          c.fn = resolve(e.binary.op, [](auto k) -> Fn { return binary_literal_left<decltype(k)::value>; });
+          c.value = l.literal;
+          c.operands.push_back(compile(r));
+        } else {
+          c.fn = resolve(e.binary.op, [](auto k) -> Fn { return binary<decltype(k)::value>; });
+          c.operands.push_back(compile(l));
+          c.operands.push_back(compile(r));
+        }
+        break;
+      }
+      case E::Kind::Nary:
+        c.fn = resolve(e.nary.op, [](auto k) -> Fn { return nary<decltype(k)::value>; });
+        c.operands.reserve(e.nary.operands.size());
+        for (const auto& x: e.nary.operands) c.operands.push_back(compile(*x));
+        c.offsets = e.nary.offsets;
+        break;
+    }
+    return c;
+  }
 
-  for (int i = 1; i < argc; i++) {
-    string arg = argv[i];
-    if (stream != "") {
-      throw std::runtime_error("Too many arguments");
+  Value eval(const N& num, std::span<const Value> vars = {}) const {
+    return fn(*this, num, vars);
+  }
+
+private:
+  Fn fn = none;
+  // Literal: the value. Binary: the literal operand, if there is one.
+  Value value {};
+  // Variable: index into the bindings and the name for errors
+  usize slot = 0;
+  string name;
+  // Unary and Binary: the operator's offset in the source
+  usize offset = NOWHERE;
+  // Nary: as in Expr::nary
+  vector<usize> offsets;
+  vector<Closure> operands;
+
+  template <Op::Kind K, typename... Values>
+  static Value apply(const Closure& c, const N& num, Values&&... xs) {
+    try {
+      return Op(K).eval(num, std::forward<Values>(xs)...);
+    } catch (const std::runtime_error&) {
+      rethrow_at(c.offset);
     }
-    stream = arg;
   }
 
-  Tokenizer tokenizer(stream);
-  auto tokens = tokenizer.tokenize();
+  // Calls pick with the operator as a std::integral_constant, so that it can
+  // choose a function instantiated for it
+  template <typename F>
+  static Fn resolve(Op op, F&& pick) {
+    switch (op.kind) {
+      #define X(op, _0, _1, _2, _3) case Op::Kind::op: return pick(std::integral_constant<Op::Kind, Op::Kind::op>{});
+      OP_LIST
+      #undef X
+    }
+    throw std::runtime_error(format("Invalid operator '{}'. This should be unreachable.", op.symbol()));
+  }
+
+  static Value none(const Closure&, const N&, std::span<const Value>) {
+    throw std::runtime_error("Attempt to eval expr of type None");
+  }
 
-  if (print_tokens) {
-    cout << "#== Tokens ==\n";
+  static Value literal(const Closure& c, const N&, std::span<const Value>) {
+    return c.value;
+  }
 
-    for (auto tok: tokens) {
-      std::cout << tok.str() << "\n";
+  static Value variable(const Closure& c, const N&, std::span<const Value> vars) {
+    if (c.slot >= vars.size()) throw std::runtime_error(format("Unbound variable '{}'", c.name));
+    return vars[c.slot];
+  }
+
+  template <Op::Kind K>
+  static Value unary(const Closure& c, const N& num, std::span<const Value> vars) {
+    return apply<K>(c, num, c.operands[0].eval(num, vars));
+  }
+
+  template <Op::Kind K>
+  static Value binary(const Closure& c, const N& num, std::span<const Value> vars) {
+    Value left = c.operands[0].eval(num, vars);
+    Value right = c.operands[1].eval(num, vars);
+    return apply<K>(c, num, std::move(left), std::move(right));
+  }
+
+  template <Op::Kind K>
+  static Value binary_literal_left(const Closure& c, const N& num, std::span<const Value> vars) {
+    return apply<K>(c, num, c.value, c.operands[0].eval(num, vars));
+  }
+
+  template <Op::Kind K>
+  static Value binary_literal_right(const Closure& c, const N& num, std::span<const Value> vars) {
+    return apply<K>(c, num, c.operands[0].eval(num, vars), c.value);
+  }
+
+  template <Op::Kind K>
+  static Value nary(const Closure& c, const N& num, std::span<const Value> vars) {
+    const auto& operands = c.operands;
+    return eval_chain(num, Op(K), operands.size(), [&](usize i) { return operands[i].eval(num, vars); }, c.offsets);
+  }
+};
+//== end closure compilation }}}
+
+//== Bytecode ===== {{{
+// Compiles an Expr into instructions for a stack machine. Chains are
+// emitted as the equivalent left-deep binary tree, which has the same
+// results and errors as Expr::eval_nary.
+//
+// The interpreter jumps from handler to handler through a table of label
+// addresses on GCC and Clang, so each handler ends with its own indirect
+// branch instead of all of them sharing the one of a switch. Define
+// PRATT_SWITCH_DISPATCH to use the switch everywhere.
+#if defined(__GNUC__) && !defined(PRATT_SWITCH_DISPATCH)
+#define PRATT_THREADED_DISPATCH 1
+#else
+#define PRATT_THREADED_DISPATCH 0
+#endif
+
+// Superinstructions, generated by --profile from a sample of batch input.
+// X(operand, op) replaces pushing a Literal or Variable and then applying
+// op to the top two values; X(left, op, right) replaces pushing two
+// operands and applying op to them.
+#define FUSED_PAIRS \
+  X(Variable, Mul) \
+  X(Literal, Exp) \
+  X(Literal, Sub) \
+  X(Literal, Add) \
+  X(Variable, Add) \
+  X(Literal, Div) \
+  X(Variable, Sub) \
+
+#define FUSED_TRIPLES \
+  X(Literal, Mul, Variable) \
+  X(Variable, Exp, Literal) \
+  X(Variable, Sub, Literal) \
+  X(Variable, Mul, Variable) \
+  X(Variable, Add, Variable) \
+  X(Variable, Add, Literal) \
+  X(Variable, Sub, Variable) \
+  X(Variable, Div, Literal) \
+
+template <typename N>
+class Bytecode {
+  using E = Expr<N>;
+  using Value = typename N::Value;
+
+public:
+  enum class Code : u8 {
+    Literal,  // push constants[arg]
+    Variable, // push vars[arg]
+    #define X(op, _0, _1, _2, _3) Unary##op, Binary##op,
+    OP_LIST
+    #undef X
+    #define X(a, op) Binary##op##a,
+    FUSED_PAIRS
+    #undef X
+    #define X(a, op, b) a##op##b,
+    FUSED_TRIPLES
+    #undef X
+    Return,
+  };
+
+  struct Instr {
+    Code code;
+    // the operand of Literal and Variable, the first of a triple
+    u32 arg = 0;
+    // the second operand of a triple
+    u32 arg2 = 0;
+  };
+
+  // Without fuse only the basic instructions are used
+  static Bytecode compile(const E& e, bool fuse = true) {
+    Bytecode b;
+    usize depth = 0;
+    b.emit(e, depth);
+    if (fuse) b.fuse();
+    b.add({Code::Return});
+    return b;
+  }
+
+  Value eval(const N& num, std::span<const Value> vars = {}) const {
+    return run(num, code.data(), constants.data(), max_depth, vars, [&](u32 slot) -> const string& { return names[slot]; },
+               offsets.data());
+  }
+
+  // Runs code that ends in Return and needs a stack of max_depth values,
+  // wherever it lives, e.g. in a mapped Image. unbound(slot) names a
+  // variable that vars has no value for. offsets, if given, holds the
+  // source offset of each instruction's operator for errors.
+  template <typename Unbound>
+  static Value run(const N& num, const Instr* code, const Value* constants, usize max_depth, std::span<const Value> vars,
+                   Unbound&& unbound, const usize* offsets = nullptr) {
+    // machine words need no construction, so shallow programs keep the stack in a local array
+    if constexpr (std::is_trivially_default_constructible_v<Value>) {
+      if (max_depth <= INLINE_DEPTH) {
+        Value stack[INLINE_DEPTH];
+        return run(num, code, constants, vars, stack, unbound, offsets);
+      }
     }
+    vector<Value> stack(max_depth);
+    return run(num, code, constants, vars, stack.data(), unbound, offsets);
+  }
 
-    cout << "\n";
+  const vector<Instr>& instructions() const { return code; }
+  const vector<Value>& literals() const { return constants; }
+  // variable names by slot
+  const vector<string>& variables() const { return names; }
+  usize stack_depth() const { return max_depth; }
+
+  static string name(Code c) {
+    switch (c) {
+      case Code::Literal: return "Literal";
+      case Code::Variable: return "Variable";
+      #define X(op, _0, _1, _2, _3) case Code::Unary##op: return "Unary" #op; case Code::Binary##op: return "Binary" #op;
+      OP_LIST
+      #undef X
+      #define X(a, op) case Code::Binary##op##a: return "Binary" #op #a;
+      FUSED_PAIRS
+      #undef X
+      #define X(a, op, b) case Code::a##op##b: return #a #op #b;
+      FUSED_TRIPLES
+      #undef X
+      case Code::Return: return "Return";
+    }
+    throw std::runtime_error("Invalid instruction. This should be unreachable.");
   }
 
-  Parser p {.tokens = tokens};
-  auto expr = p.parse_expr();
+  static bool is_operand(Code c) { return c == Code::Literal || c == Code::Variable; }
 
-  if (print_ast) {
-    cout << "#== AST =====\n";
-    std::cout << expr->str() << "\n\n";
+  // The operator of a basic binary instruction
+  static optional<Op> binary_op(Code c) {
+    #define X(op, _0, _1, _2, _3) if (c == Code::Binary##op) return Op(Op::Kind::op);
+    OP_LIST
+    #undef X
+    return {};
+  }
+
+  // How an instruction changes the stack, and whether arg and arg2 index
+  // literals or variables
+  struct Effect {
+    usize pops = 0;
+    usize pushes = 1;
+    std::array<Code, 2> operands {};
+    usize count = 0;
+  };
+
+  // Return ends the program instead
+  static optional<Effect> effect(Code c) {
+    switch (c) {
+      case Code::Literal:
+      case Code::Variable: return Effect {.operands = {c}, .count = 1};
+      #define X(op, _0, _1, _2, _3) case Code::Unary##op: return Effect {.pops = 1}; case Code::Binary##op: return Effect {.pops = 2};
+      OP_LIST
+      #undef X
+      #define X(a, op) case Code::Binary##op##a: return Effect {.pops = 1, .operands = {Code::a}, .count = 1};
+      FUSED_PAIRS
+      #undef X
+      #define X(a, op, b) case Code::a##op##b: return Effect {.operands = {Code::a, Code::b}, .count = 2};
+      FUSED_TRIPLES
+      #undef X
+      case Code::Return: return {};
+    }
+    return {};
+  }
+
+private:
+  vector<Instr> code;
+  // by instruction, the source offset of its operator, for errors
+  vector<usize> offsets;
+  vector<Value> constants;
+  // variable names by slot, for errors
+  vector<string> names;
+  usize max_depth = 0;
+
+  static constexpr usize INLINE_DEPTH = 32;
+
+  template <typename Unbound>
+  static Value run(const N& num, const Instr* ip, const Value* constants, std::span<const Value> vars, Value* stack,
+                   Unbound& unbound, const usize* offsets) {
+    usize sp = 0;
+    const Instr* start = ip;
+    const Instr* in = ip;
+    bool unbound_variable = false;
+    auto variable = [&](u32 slot) -> const Value& {
+      if (slot >= vars.size()) {
+        unbound_variable = true;
+        throw std::runtime_error(format("Unbound variable '{}'", unbound(slot)));
+      }
+      return vars[slot];
+    };
+    try {
+
+#if PRATT_THREADED_DISPATCH
+    static const void* const labels[] = {
+      &&do_Literal,
+      &&do_Variable,
+      #define X(op, _0, _1, _2, _3) &&do_Unary##op, &&do_Binary##op,
+      OP_LIST
+      #undef X
+      #define X(a, op) &&do_Binary##op##a,
+      FUSED_PAIRS
+      #undef X
+      #define X(a, op, b) &&do_##a##op##b,
+      FUSED_TRIPLES
+      #undef X
+      &&do_Return,
+    };
+    #define DISPATCH() do { in = ip++; goto *labels[(usize)in->code]; } while (0)
+    #define HANDLER(name) do_##name:
+    DISPATCH();
+#else
+    #define DISPATCH() break
+    #define HANDLER(name) case Code::name:
+    for (;;) {
+      in = ip++;
+      switch (in->code) {
+#endif
+
+    #define OPERAND_Literal(arg) constants[arg]
+    #define OPERAND_Variable(arg) variable(arg)
+    HANDLER(Literal)
+      stack[sp++] = OPERAND_Literal(in->arg);
+      DISPATCH();
+    HANDLER(Variable)
+      stack[sp++] = OPERAND_Variable(in->arg);
+      DISPATCH();
+    #define X(op, _0, _1, _2, _3) \
+    HANDLER(Unary##op) \
+      stack[sp - 1] = Op(Op::Kind::op).eval(num, std::move(stack[sp - 1])); \
+      DISPATCH(); \
+    HANDLER(Binary##op) \
+      sp--; \
+      stack[sp - 1] = Op(Op::Kind::op).eval(num, std::move(stack[sp - 1]), std::move(stack[sp])); \
+      DISPATCH();
+    OP_LIST
+    #undef X
+    #define X(a, op) \
+    HANDLER(Binary##op##a) \
+      stack[sp - 1] = Op(Op::Kind::op).eval(num, std::move(stack[sp - 1]), OPERAND_##a(in->arg)); \
+      DISPATCH();
+    FUSED_PAIRS
+    #undef X
+    #define X(a, op, b) \
+    HANDLER(a##op##b) { \
+      Value left = OPERAND_##a(in->arg); \
+      stack[sp++] = Op(Op::Kind::op).eval(num, std::move(left), OPERAND_##b(in->arg2)); \
+      DISPATCH(); \
+    }
+    FUSED_TRIPLES
+    #undef X
+    HANDLER(Return)
+      return std::move(stack[0]);
+
+#if !PRATT_THREADED_DISPATCH
+      }
+    }
+#endif
+    } catch (const std::runtime_error&) {
+      rethrow_at(offsets == nullptr || unbound_variable ? NOWHERE : offsets[in - start]);
+    }
+    #undef OPERAND_Literal
+    #undef OPERAND_Variable
+    #undef DISPATCH
+    #undef HANDLER
+  }
+
+  void add(Instr in, usize offset = NOWHERE) {
+    code.push_back(in);
+    offsets.push_back(offset);
+  }
+
+  void push(Instr in, usize& depth) {
+    add(in);
+    max_depth = std::max(max_depth, ++depth);
+  }
+
+  static Code unary(Op op) {
+    switch (op.kind) {
+      #define X(op, _0, _1, _2, _3) case Op::Kind::op: return Code::Unary##op;
+      OP_LIST
+      #undef X
+    }
+    throw std::runtime_error(format("Invalid unary operator '{}'. This should be unreachable.", op.symbol()));
+  }
+
+  static Code binary(Op op) {
+    switch (op.kind) {
+      #define X(op, _0, _1, _2, _3) case Op::Kind::op: return Code::Binary##op;
+      OP_LIST
+      #undef X
+    }
+    throw std::runtime_error(format("Invalid infix operator '{}'. This should be unreachable.", op.symbol()));
   }
 
-  auto result = expr->eval();
+  // depth is the height of the stack before e and after it minus one
+  void emit(const E& e, usize& depth) {
+    switch (e.kind) {
+      case E::Kind::None: throw std::runtime_error("Attempt to eval expr of type None");
+      case E::Kind::Literal:
+        push({Code::Literal, (u32)constants.size()}, depth);
+        constants.push_back(e.literal);
+        break;
+      case E::Kind::Variable:
+        if (names.size() <= e.var.slot) names.resize(e.var.slot + 1);
+        names[e.var.slot] = e.var.name;
+        push({Code::Variable, (u32)e.var.slot}, depth);
+        break;
+      case E::Kind::Unary:
+        emit(*e.unary.expr, depth);
+        add({unary(e.unary.op)}, e.offset);
+        break;
+      case E::Kind::Binary:
+        emit(*e.binary.left, depth);
+        emit(*e.binary.right, depth);
+        add({binary(e.binary.op)}, e.offset);
+        depth--;
+        break;
+      case E::Kind::Nary:
+        emit(*e.nary.operands[0], depth);
+        for (usize i = 1; i < e.nary.operands.size(); i++) {
+          emit(*e.nary.operands[i], depth);
+          add({binary(e.nary.op)}, i < e.nary.offsets.size() ? e.nary.offsets[i] : NOWHERE);
+          depth--;
+        }
+        break;
+    }
+  }
+
+  static optional<Code> fused(Code a, Code op) {
+    #define X(x, o) if (a == Code::x && op == Code::Binary##o) return Code::Binary##o##x;
+    FUSED_PAIRS
+    #undef X
+    return {};
+  }
+
+  static optional<Code> fused(Code a, Code b, Code op) {
+    #define X(x, o, y) if (a == Code::x && b == Code::y && op == Code::Binary##o) return Code::x##o##y;
+    FUSED_TRIPLES
+    #undef X
+    return {};
+  }
+
+  // Replaces runs of instructions with superinstructions, longest first.
+  // There are no jumps, so any run can be replaced. A superinstruction
+  // keeps the offset of the operator that ends its run.
+  void fuse() {
+    vector<Instr> res;
+    vector<usize> res_offsets;
+    for (usize i = 0; i < code.size();) {
+      if (i + 2 < code.size()) {
+        if (auto c = fused(code[i].code, code[i + 1].code, code[i + 2].code)) {
+          res.push_back({c.value(), code[i].arg, code[i + 1].arg});
+          res_offsets.push_back(offsets[i + 2]);
+          i += 3;
+          continue;
+        }
+      }
+      if (i + 1 < code.size()) {
+        if (auto c = fused(code[i].code, code[i + 1].code)) {
+          res.push_back({c.value(), code[i].arg});
+          res_offsets.push_back(offsets[i + 1]);
+          i += 2;
+          continue;
+        }
+      }
+      res.push_back(code[i]);
+      res_offsets.push_back(offsets[i++]);
+    }
+    code = std::move(res);
+    offsets = std::move(res_offsets);
+  }
+};
+//== end bytecode }}}
+
+//== Tiered execution ===== {{{
+// Expressions start on the tree walk, which costs nothing up front, and are
+// compiled to faster engines once they have been called often enough:
+// first to a Closure, then to fused Bytecode. Compiling happens on a
+// background thread. When it is done the expression's entry point is
+// swapped atomically, so callers never wait for a compile. There is no
+// native code tier; see --emit-cpp for compiling ahead of time.
+
+enum class Tier : u8 { Tree, Closure, Bytecode, COUNT };
+
+constexpr string_view tier_name(Tier t) {
+  switch (t) {
+    case Tier::Tree: return "tree";
+    case Tier::Closure: return "closure";
+    case Tier::Bytecode: return "bytecode";
+    case Tier::COUNT: break;
+  }
+  return "?";
+}
+
+// Calls after which an expression is promoted to each tier
+struct TierPolicy {
+  usize closure_after = 64;
+  usize bytecode_after = 4096;
+};
+
+struct TierMetrics {
+  TierPolicy policy;
+  usize expressions = 0;
+  // expressions promoted to each tier; Tree is never a target
+  usize promotions[(usize)Tier::COUNT] {};
+  // requested promotions not done yet
+  usize pending = 0;
+  // promotions whose compile threw; the expression stays on its tier
+  usize failed = 0;
+  f64 compile_micros = 0;
+
+  string str() const {
+    string res = format("thresholds: closure after {} calls, bytecode after {}\n", policy.closure_after, policy.bytecode_after);
+    res += format("expressions: {}, pending promotions: {}, failed: {}, compile time {:.1f} us\n", expressions, pending,
+                  failed, compile_micros);
+    res += "promotions:";
+    for (usize t = 1; t < (usize)Tier::COUNT; t++) res += format(" {} {}", tier_name((Tier)t), promotions[t]);
+    return res;
+  }
+};
+
+template <typename N>
+class Tiering;
+
+template <typename N>
+class TieredExpr: public std::enable_shared_from_this<TieredExpr<N>> {
+  using Value = typename N::Value;
+  using Entry = Value (*)(const TieredExpr&, std::span<const Value>);
+
+public:
+  TieredExpr(Tiering<N>& owner, unique_ptr<Expr<N>> expr): owner(owner), expr(std::move(expr)) {}
+
+  // Same values and errors as Expr::eval, on whichever tier is current
+  Value eval(std::span<const Value> vars = {}) {
+    usize n = calls.fetch_add(1, std::memory_order_relaxed) + 1;
+    // fetch_add hands out every count once, so each tier is requested once
+    if (n == owner.policy.closure_after) owner.request(this->shared_from_this(), Tier::Closure);
+    if (n == owner.policy.bytecode_after) owner.request(this->shared_from_this(), Tier::Bytecode);
+    return entry.load(std::memory_order_acquire)(*this, vars);
+  }
+
+  Tier tier() const { return current.load(std::memory_order_acquire); }
+  usize call_count() const { return calls.load(std::memory_order_relaxed); }
+  const Expr<N>& tree() const { return *expr; }
+
+private:
+  friend class Tiering<N>;
+
+  Tiering<N>& owner;
+  const unique_ptr<Expr<N>> expr;
+  // written once by the promoting thread before the entry that reads it is published
+  unique_ptr<Closure<N>> closure;
+  unique_ptr<Bytecode<N>> bytecode;
+  std::atomic<usize> calls = 0;
+  std::atomic<Tier> current = Tier::Tree;
+  std::atomic<Entry> entry = eval_tree;
+
+  static Value eval_tree(const TieredExpr& e, std::span<const Value> vars) { return e.expr->eval(e.owner.num, vars); }
+  static Value eval_closure(const TieredExpr& e, std::span<const Value> vars) { return e.closure->eval(e.owner.num, vars); }
+  static Value eval_bytecode(const TieredExpr& e, std::span<const Value> vars) { return e.bytecode->eval(e.owner.num, vars); }
+
+  // Only called on the promoting thread. A promotion to a tier at or below
+  // the current one does nothing. Returns whether the tier changed.
+  bool promote(Tier to) {
+    if (to <= current.load(std::memory_order_relaxed)) return false;
+    if (to == Tier::Closure) {
+      closure = make_unique<Closure<N>>(Closure<N>::compile(*expr));
+      entry.store(eval_closure, std::memory_order_release);
+    } else {
+      bytecode = make_unique<Bytecode<N>>(Bytecode<N>::compile(*expr));
+      entry.store(eval_bytecode, std::memory_order_release);
+    }
+    current.store(to, std::memory_order_release);
+    return true;
+  }
+};
+
+// Owns the promotion thread and hands out TieredExprs. It must outlive
+// every call to their eval; the expressions themselves may go away with
+// promotions still queued. It keeps its own copy of the backend.
+template <typename N>
+class Tiering {
+public:
+  Tiering(const N& num, TierPolicy policy = {}): num(num), policy(policy), worker([this] { promote_loop(); }) {}
+
+  ~Tiering() {
+    {
+      std::lock_guard guard(lock);
+      stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+  }
+
+  Tiering(const Tiering&) = delete;
+  Tiering& operator=(const Tiering&) = delete;
+
+  shared_ptr<TieredExpr<N>> add(unique_ptr<Expr<N>> expr) {
+    expressions.fetch_add(1, std::memory_order_relaxed);
+    return make_shared<TieredExpr<N>>(*this, std::move(expr));
+  }
+
+  // Blocks until every promotion requested so far is done
+  void wait() {
+    std::unique_lock guard(lock);
+    idle.wait(guard, [&] { return queue.empty() && !busy; });
+  }
+
+  TierMetrics metrics() const {
+    TierMetrics m {.policy = policy, .expressions = expressions.load(std::memory_order_relaxed)};
+    for (usize t = 0; t < (usize)Tier::COUNT; t++) m.promotions[t] = promotions[t].load(std::memory_order_relaxed);
+    m.failed = failed.load(std::memory_order_relaxed);
+    m.compile_micros = compile_nanos.load(std::memory_order_relaxed) / 1e3;
+    std::lock_guard guard(lock);
+    m.pending = queue.size() + busy;
+    return m;
+  }
+
+private:
+  friend class TieredExpr<N>;
+
+  const N num;
+  const TierPolicy policy;
+  mutable std::mutex lock;
+  std::condition_variable changed, idle;
+  std::deque<pair<std::weak_ptr<TieredExpr<N>>, Tier>> queue;
+  bool stopping = false;
+  // a promotion has been taken off the queue and is being compiled
+  bool busy = false;
+  std::atomic<usize> expressions = 0;
+  std::atomic<usize> promotions[(usize)Tier::COUNT] {};
+  std::atomic<usize> failed = 0;
+  std::atomic<u64> compile_nanos = 0;
+  // last, so that everything it uses is initialized before it starts
+  std::thread worker;
+
+  void request(std::weak_ptr<TieredExpr<N>> e, Tier to) {
+    {
+      std::lock_guard guard(lock);
+      queue.emplace_back(std::move(e), to);
+    }
+    changed.notify_one();
+  }
+
+  void promote_loop() {
+    std::unique_lock guard(lock);
+    while (true) {
+      changed.wait(guard, [&] { return stopping || !queue.empty(); });
+      if (stopping) return;
+      auto [weak, to] = std::move(queue.front());
+      queue.pop_front();
+      busy = true;
+      guard.unlock();
+      if (auto e = weak.lock()) {
+        auto start = std::chrono::steady_clock::now();
+        try {
+          if (e->promote(to)) {
+            promotions[(usize)to].fetch_add(1, std::memory_order_relaxed);
+            compile_nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+          }
+        } catch (...) {
+          // promote publishes nothing until its compile is done
+          failed.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      guard.lock();
+      busy = false;
+      if (queue.empty()) idle.notify_all();
+    }
+  }
+};
+//== end tiered execution }}}
+
+//== Parallel evaluation ===== {{{
+// Evaluates one large tree on several threads. Subtrees of at least CUTOFF
+// nodes are forked as tasks onto a work-stealing pool, smaller ones are
+// evaluated sequentially. Evaluation has no side effects, so the result is
+// the same; errors are collected per task and rethrown in the order the
+// sequential evaluator would have hit them.
+
+// A fork-join pool. Every thread owns a deque of tasks: it pushes and pops
+// at the back, and idle threads steal from the front of the others. The
+// thread that creates the pool is worker 0 and only runs tasks while it
+// waits for a join.
+class WorkStealingPool {
+public:
+  // Counts the outstanding tasks forked against it
+  struct Join {
+    std::atomic<usize> pending = 0;
+  };
+
+  explicit WorkStealingPool(usize threads): queues(std::max<usize>(threads, 1)) {
+    for (auto& q: queues) q = make_unique<Queue>();
+    worker = 0;
+    for (usize i = 1; i < queues.size(); i++) {
+      workers.emplace_back([this, i] {
+        worker = i;
+        usize idle = 0;
+        while (!stopping.load(std::memory_order_acquire)) {
+          if (run_one()) idle = 0;
+          else if (++idle < 64) std::this_thread::yield();
+          else std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+      });
+    }
+  }
+
+  ~WorkStealingPool() {
+    stopping.store(true, std::memory_order_release);
+    for (auto& t: workers) t.join();
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  usize size() const { return queues.size(); }
+
+  // task must not throw
+  void fork(Join& join, std::function<void()> task) {
+    join.pending.fetch_add(1, std::memory_order_relaxed);
+    auto& q = *queues[worker];
+    std::lock_guard guard(q.lock);
+    q.tasks.push_back([&join, task = std::move(task)] {
+      task();
+      join.pending.fetch_sub(1, std::memory_order_release);
+    });
+  }
+
+  // Runs queued tasks, ours or stolen, until everything forked against join is done
+  void wait(Join& join) {
+    while (join.pending.load(std::memory_order_acquire) != 0) {
+      if (!run_one()) std::this_thread::yield();
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool run_one() {
+    std::function<void()> task;
+    usize self = worker;
+    {
+      auto& q = *queues[self];
+      std::lock_guard guard(q.lock);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      }
+    }
+    for (usize i = 1; !task && i < queues.size(); i++) {
+      auto& q = *queues[(self + i) % queues.size()];
+      std::lock_guard guard(q.lock);
+      if (!q.tasks.empty()) {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+    }
+    if (!task) return false;
+    task();
+    return true;
+  }
+
+  vector<unique_ptr<Queue>> queues;
+  vector<std::thread> workers;
+  std::atomic<bool> stopping = false;
+  // index of the calling thread's queue
+  static inline thread_local usize worker = 0;
+};
+
+template <typename N>
+class ParallelEvaluator {
+  using E = Expr<N>;
+  using Value = typename N::Value;
+
+public:
+  // Smallest subtree, in nodes, that is worth a task
+  static constexpr usize CUTOFF = 1 << 12;
+
+  ParallelEvaluator(const N& num, std::span<const Value> vars, WorkStealingPool& pool):
+    num(num), vars(vars), pool(pool) {}
+
+  Value eval(const E& expr) {
+    if (pool.size() == 1 || measure(expr) < CUTOFF) return expr.eval(num, vars);
+    return eval_node(expr);
+  }
+
+private:
+  // The value of a subtree or the error evaluating it threw
+  struct Outcome {
+    Value value {};
+    std::exception_ptr error;
+
+    Value get() && {
+      if (error) std::rethrow_exception(error);
+      return std::move(value);
+    }
+  };
+
+  const N& num;
+  std::span<const Value> vars;
+  WorkStealingPool& pool;
+  // sizes of the subtrees of at least CUTOFF nodes; everything else is sequential
+  std::unordered_map<const E*, usize> large;
+  // for large chains, where each run of operands of about CUTOFF nodes ends
+  std::unordered_map<const E*, vector<usize>> chunks;
+
+  bool is_large(const E& e) const { return large.contains(&e); }
+
+  usize measure(const E& e) {
+    usize n = 1;
+    switch (e.kind) {
+      case E::Kind::Unary: n += measure(*e.unary.expr); break;
+      case E::Kind::Binary: n += measure(*e.binary.left) + measure(*e.binary.right); break;
+      case E::Kind::Nary: {
+        // A chain is rebalanced into runs of operands that become tasks
+        vector<usize> ends;
+        usize run = 0;
+        for (usize i = 0; i < e.nary.operands.size(); i++) {
+          usize m = measure(*e.nary.operands[i]);
+          n += m;
+          run += m;
+          if (run >= CUTOFF) {
+            ends.push_back(i + 1);
+            run = 0;
+          }
+        }
+        if (ends.empty() || ends.back() != e.nary.operands.size()) ends.push_back(e.nary.operands.size());
+        if (ends.size() > 1) chunks.emplace(&e, std::move(ends));
+        break;
+      }
+      default: break;
+    }
+    if (n >= CUTOFF) large.emplace(&e, n);
+    return n;
+  }
+
+  Outcome attempt(const E& e) {
+    try {
+      return {eval_node(e)};
+    } catch (...) {
+      return {{}, std::current_exception()};
+    }
+  }
+
+  Value eval_node(const E& e) {
+    if (!is_large(e)) return e.eval(num, vars);
+    switch (e.kind) {
+      case E::Kind::Unary: {
+        Value x = eval_node(*e.unary.expr);
+        try {
+          return e.unary.op.eval(num, std::move(x));
+        } catch (const std::runtime_error&) {
+          rethrow_at(e.offset);
+        }
+      }
+      case E::Kind::Binary: {
+        // the left operand is evaluated here, the right one forked when it is
+        // worth it. Left errors come first, as in Expr::eval.
+        Value left, right;
+        if (!is_large(*e.binary.right)) {
+          left = eval_node(*e.binary.left);
+          right = e.binary.right->eval(num, vars);
+        } else {
+          WorkStealingPool::Join join;
+          Outcome r;
+          pool.fork(join, [&] { r = attempt(*e.binary.right); });
+          Outcome l = attempt(*e.binary.left);
+          pool.wait(join);
+          left = std::move(l).get();
+          right = std::move(r).get();
+        }
+        try {
+          return e.binary.op.eval(num, std::move(left), std::move(right));
+        } catch (const std::runtime_error&) {
+          rethrow_at(e.offset);
+        }
+      }
+      case E::Kind::Nary: return eval_chain(e);
+      default: return e.eval(num, vars);
+    }
+  }
+
+  // The offset of the operator before operand i of a chain
+  static usize offset(const E& e, usize i) {
+    return i < e.nary.offsets.size() ? e.nary.offsets[i] : NOWHERE;
+  }
+
+  // acc op values[0] op ..., where values[0] is operand first of the chain
+  Value reduce(const E& e, Value acc, std::span<Value> values, usize first) {
+    usize step = 0;
+    try {
+      return e.nary.op.reduce(num, std::move(acc), values, step);
+    } catch (const std::runtime_error&) {
+      rethrow_at(offset(e, first + step));
+    }
+  }
+
+  // acc op x, where x is operand i of the chain
+  Value apply(const E& e, Value acc, Value x, usize i) {
+    try {
+      return e.nary.op.eval(num, std::move(acc), std::move(x));
+    } catch (const std::runtime_error&) {
+      rethrow_at(offset(e, i));
+    }
+  }
+
+  // Evaluates the operands of a chain, one task per run of operands
+  Value eval_chain(const E& e) {
+    const auto& operands = e.nary.operands;
+    auto it = chunks.find(&e);
+    if (it == chunks.end()) {
+      vector<Value> values;
+      for (const auto& x: operands) {
+        Outcome o = attempt(*x);
+        if (o.error) {
+          // as in Expr::eval_nary, the operator is applied to everything before the failing operand first
+          if (!values.empty()) reduce(e, std::move(values[0]), std::span(values).subspan(1), 1);
+          std::rethrow_exception(o.error);
+        }
+        values.push_back(std::move(o.value));
+      }
+      return reduce(e, std::move(values[0]), std::span(values).subspan(1), 1);
+    }
+
+    const auto& ends = it->second;
+    WorkStealingPool::Join join;
+    if constexpr (N::EXACT) {
+      // + and * are associative and do not throw, so each run is reduced on its
+      // own and the partial results combined in order. The first error is
+      // the one from the leftmost failing operand.
+      vector<Outcome> partial(ends.size());
+      auto reduce_run = [&](usize r) {
+        usize begin = r == 0 ? 0 : ends[r - 1];
+        vector<Value> values;
+        for (usize i = begin; i < ends[r]; i++) {
+          Outcome o = attempt(*operands[i]);
+          if (o.error) {
+            partial[r] = std::move(o);
+            return;
+          }
+          values.push_back(std::move(o.value));
+        }
+        partial[r].value = reduce(e, std::move(values[0]), std::span(values).subspan(1), begin + 1);
+      };
+      for (usize r = 1; r < ends.size(); r++) pool.fork(join, [&, r] { reduce_run(r); });
+      reduce_run(0);
+      pool.wait(join);
+      Value acc = std::move(partial[0]).get();
+      for (usize r = 1; r < ends.size(); r++) acc = apply(e, std::move(acc), std::move(partial[r]).get(), ends[r - 1]);
+      return acc;
+    } else {
+      // Regrouping could round or overflow differently, so only the operands
+      // are evaluated in parallel and then reduced left to right.
+      vector<Outcome> values(operands.size());
+      auto eval_run = [&](usize r) {
+        for (usize i = r == 0 ? 0 : ends[r - 1]; i < ends[r]; i++) values[i] = attempt(*operands[i]);
+      };
+      for (usize r = 1; r < ends.size(); r++) pool.fork(join, [&, r] { eval_run(r); });
+      eval_run(0);
+      pool.wait(join);
+      Value acc = std::move(values[0]).get();
+      for (usize i = 1; i < values.size(); i++) acc = apply(e, std::move(acc), std::move(values[i]).get(), i);
+      return acc;
+    }
+  }
+};
+//== end parallel evaluation }}}
+
+//== Parallel parsing ===== {{{
+// Parses one large token stream on several threads. The infix operators
+// outside all parens with the lowest binding power are the ones the
+// sequential parser handles in its outermost loop, so the tokens between
+// them can be parsed independently and the pieces joined with
+// Parser::apply in the order the sequential parser would have applied them.
+// Anything that does not fit that shape, including every syntax error, is
+// left to the sequential parser, so the tree, the variable slots and the
+// error messages are always the same.
+
+// Whether an operator token sits where an operand is expected, i.e. is a
+// prefix operator. Only looks back over the run of operators before it.
+inline bool prefix_position(std::span<const Token> tokens, usize i) {
+  usize j = i;
+  while (j > 0 && tokens[j - 1].kind == Token::Kind::Op) j--;
+  bool operand = j == 0 || tokens[j - 1].kind == Token::Kind::LParen;
+  for (; j < i; j++) {
+    // after an operand only a postfix operator keeps us after an operand
+    if (!operand) operand = !tokens[j].op.postfix_binding_power().has_value();
+  }
+  return operand;
+}
+
+template <typename N>
+class ParallelParser {
+  using E = Expr<N>;
+  using Operand = typename Parser<N>::Operand;
+
+public:
+  // Smallest token stream worth splitting
+  static constexpr usize CUTOFF = 1 << 14;
+
+  ParallelParser(Parser<N>& parser, WorkStealingPool& pool): parser(parser), pool(pool) {}
+
+  // Same as parser.parse_expr() from the start of its tokens
+  unique_ptr<E> parse() {
+    std::span<const Token> tokens = parser.tokens;
+    if (pool.size() == 1 || tokens.size() < CUTOFF) return parser.parse_expr();
+    try {
+      if (auto expr = parse_split(); expr) return expr;
+    } catch (const std::runtime_error&) {}
+    parser.index = 0;
+    parser.variables.clear();
+    return parser.parse_expr();
+  }
+
+private:
+  Parser<N>& parser;
+  WorkStealingPool& pool;
+
+  usize blocks(usize n) const { return std::min(n, pool.size() * 4); }
+
+  // Runs f(block, begin, end) over the blocks(n) ranges of [0, n), in parallel
+  template <typename F>
+  void for_each_block(usize n, F&& f) {
+    usize count = blocks(n);
+    WorkStealingPool::Join join;
+    for (usize b = 1; b < count; b++) pool.fork(join, [&, b] { f(b, n * b / count, n * (b + 1) / count); });
+    f(0, 0, n / count);
+    pool.wait(join);
+  }
+
+  // Paren depth before each token and, last, after all of them, as a blocked prefix sum: each block sums
+  // its +1/-1 steps, the block totals are scanned, then each block scans
+  // itself from its starting depth.
+  vector<i32> depths(std::span<const Token> tokens) {
+    auto step = [&](usize i) -> i32 {
+      return (tokens[i].kind == Token::Kind::LParen) - (tokens[i].kind == Token::Kind::RParen);
+    };
+    vector<i32> start(blocks(tokens.size()) + 1, 0);
+    vector<i32> depth(tokens.size());
+    for_each_block(tokens.size(), [&](usize b, usize begin, usize end) {
+      i32 sum = 0;
+      for (usize i = begin; i < end; i++) sum += step(i);
+      start[b + 1] = sum;
+    });
+    for (usize b = 1; b < start.size(); b++) start[b] += start[b - 1];
+    for_each_block(tokens.size(), [&](usize b, usize begin, usize end) {
+      i32 d = start[b];
+      for (usize i = begin; i < end; i++) {
+        depth[i] = d;
+        d += step(i);
+      }
+    });
+    depth.push_back(start.back());
+    return depth;
+  }
+
+  // The tree, or null when the tokens are better left to the sequential parser
+  unique_ptr<E> parse_split() {
+    std::span<const Token> tokens = parser.tokens;
+
+    // (...) parses as its content
+    usize lo = 0, hi = tokens.size();
+    vector<i32> depth = depths(tokens);
+    if (depth.back() != 0) return nullptr;
+    while (hi - lo > 2 && tokens[lo].kind == Token::Kind::LParen && tokens[hi - 1].kind == Token::Kind::RParen) {
+      // only if the first paren closes at the last token
+      bool wraps = true;
+      for (usize i = lo + 1; wraps && i < hi - 1; i++) wraps = depth[i] > depth[lo];
+      if (!wraps) break;
+      lo++;
+      hi--;
+    }
+    i32 top = depth[lo];
+
+    // the lowest left binding power of an infix operator at the top level
+    u8 lowest = std::numeric_limits<u8>::max();
+    for (usize i = lo; i < hi; i++) {
+      if (depth[i] != top || tokens[i].kind != Token::Kind::Op || prefix_position(tokens, i)) continue;
+      if (auto power = tokens[i].op.infix_binding_power(); power.has_value() && !tokens[i].op.postfix_binding_power().has_value()) {
+        lowest = std::min(lowest, power.value().first);
+      }
+    }
+    if (lowest == std::numeric_limits<u8>::max()) return nullptr;
+
+    // The split operators are handled by the outermost loop only if nothing
+    // else at the top level would take them as part of its operand: every
+    // prefix operator and every other right binding power must bind tighter.
+    vector<usize> splits;
+    optional<bool> left_assoc;
+    for (usize i = lo; i < hi; i++) {
+      if (depth[i] != top || tokens[i].kind != Token::Kind::Op) continue;
+      Op op = tokens[i].op;
+      if (prefix_position(tokens, i)) {
+        if (op.prefix_binding_power().value_or(pair<u8, u8>{0, 0}).second <= lowest) return nullptr;
+        continue;
+      }
+      auto power = op.infix_binding_power();
+      if (!power.has_value() || op.postfix_binding_power().has_value()) continue;
+      auto [l_bp, r_bp] = power.value();
+      if (l_bp != lowest) {
+        if (r_bp <= lowest) return nullptr;
+        continue;
+      }
+      // a mix of left and right associative operators at the same power is left alone
+      if (left_assoc.has_value() && left_assoc.value() != (r_bp > lowest)) return nullptr;
+      left_assoc = r_bp > lowest;
+      splits.push_back(i);
+    }
+
+    // Parse the segments between split operators. A segment after an operator
+    // is parsed with that operator's right binding power, as the sequential
+    // parser would, and must use up all of its tokens.
+    usize count = splits.size() + 1;
+    vector<Operand> operands(count);
+    vector<vector<string>> variables(count);
+    std::atomic<bool> failed = false;
+    for_each_block(count, [&](usize, usize begin, usize end) {
+      for (usize s = begin; s < end && !failed.load(std::memory_order_relaxed); s++) {
+        usize first = s == 0 ? lo : splits[s - 1] + 1;
+        usize last = s == splits.size() ? hi : splits[s];
+        u8 min_bp = s == 0 ? 0 : tokens[splits[s - 1]].op.infix_binding_power().value().second;
+        if (first == last) {
+          failed = true;
+          break;
+        }
+        Parser<N> p {.num = parser.num, .tokens = vector<Token>(tokens.begin() + first, tokens.begin() + last),
+                     .fold_constants = parser.fold_constants, .flatten_chains = parser.flatten_chains};
+        try {
+          operands[s] = p.parse_operand(min_bp, 0);
+        } catch (const std::runtime_error&) {
+          failed = true;
+          break;
+        }
+        if ((usize)p.index != p.tokens.size()) {
+          failed = true;
+          break;
+        }
+        variables[s] = std::move(p.variables);
+      }
+    });
+    if (failed) return nullptr;
+
+    // Slots are numbered in order of first appearance across the segments
+    parser.variables.clear();
+    vector<vector<usize>> slots(count);
+    for (usize s = 0; s < count; s++) {
+      for (const auto& name: variables[s]) slots[s].push_back(parser.slot(name));
+    }
+    for_each_block(count, [&](usize, usize begin, usize end) {
+      for (usize s = begin; s < end; s++) {
+        if (operands[s].expr) renumber(*operands[s].expr, slots[s]);
+      }
+    });
+
+    // a op b op c is ((a op b) op c) if op is left associative, else (a op (b op c))
+    Operand result;
+    if (left_assoc.value()) {
+      result = std::move(operands[0]);
+      for (usize s = 0; s < splits.size(); s++) {
+        result = parser.apply(tokens[splits[s]], std::move(result), std::move(operands[s + 1]));
+      }
+    } else {
+      result = std::move(operands.back());
+      for (usize s = splits.size(); s-- > 0;) {
+        result = parser.apply(tokens[splits[s]], std::move(operands[s]), std::move(result));
+      }
+    }
+    parser.index = tokens.size();
+    return std::move(result).node();
+  }
+
+  static void renumber(E& e, const vector<usize>& slots) {
+    switch (e.kind) {
+      case E::Kind::Variable: e.var.slot = slots[e.var.slot]; break;
+      case E::Kind::Unary: renumber(*e.unary.expr, slots); break;
+      case E::Kind::Binary:
+        renumber(*e.binary.left, slots);
+        renumber(*e.binary.right, slots);
+        break;
+      case E::Kind::Nary:
+        for (auto& x: e.nary.operands) renumber(*x, slots);
+        break;
+      default: break;
+    }
+  }
+};
+//== end parallel parsing }}}
+
+//== Streaming evaluation ===== {{{
+// Evaluates input of any size without building tokens or an AST: the input
+// is read in fixed-size chunks, tokenized window by window and reduced
+// on a value/operator stack as it goes. The stack only grows with nesting
+// depth, so memory does not depend on the length of the input.
+
+// Whether a window may end right after stream[i] without splitting a token.
+// Whitespace, parens and operators never occur inside a lexeme, except a
+// sign directly after an 'e', which may be part of an exponent (1e+5).
+bool ends_token(std::span<const u8> stream, usize i) {
+  u8 c = stream[i];
+  if (is_space(c) || c == '(' || c == ')') return true;
+  if (c == '+' || c == '-') return i == 0 || (stream[i-1] != 'e' && stream[i-1] != 'E');
+  #define X(op, sym, _0, _1, _2) if (c == (#sym)[0]) return true;
+  OP_LIST
+  #undef X
+  return false;
+}
+
+// Length of the longest prefix of stream that ends on a token boundary, or 0 if there is none
+usize token_boundary(std::span<const u8> stream) {
+  for (usize i = stream.size(); i-- > 0;) {
+    if (ends_token(stream, i)) return i + 1;
+  }
+  return 0;
+}
+
+// Calls f(window, offset) on consecutive windows of the input read from fd,
+// each ending on a token boundary. Regular files are mapped and handed over
+// as one window; anything else (pipes, terminals, sockets) is read in chunks
+// of chunk_size bytes, growing the buffer only for a single token that is
+// longer than that.
+template <typename F>
+void for_each_window(int fd, usize chunk_size, F&& f) {
+  struct stat st {};
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* data = mmap(nullptr, (usize)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, (usize)st.st_size, MADV_SEQUENTIAL);
+      try {
+        f(std::span<const u8>((const u8*)data, (usize)st.st_size), 0);
+      } catch (...) {
+        munmap(data, (usize)st.st_size);
+        throw;
+      }
+      munmap(data, (usize)st.st_size);
+      return;
+    }
+  }
+
+  vector<u8> buf(chunk_size);
+  usize len = 0, offset = 0;
+  bool eof = false;
+  while (!eof) {
+    isize n = read(fd, buf.data() + len, buf.size() - len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error(format("Read failed: {}", std::strerror(errno)));
+    }
+    eof = n == 0;
+    len += (usize)n;
+
+    usize cut = eof ? len : token_boundary({buf.data(), len});
+    if (cut == 0) {
+      if (len == buf.size()) buf.resize(2 * buf.size());
+      continue;
+    }
+    f(std::span<const u8>(buf.data(), cut), offset);
+    std::copy(buf.begin() + cut, buf.begin() + len, buf.begin());
+    len -= cut;
+    offset += cut;
+  }
+}
+
+// Shunting-yard reduction driven by the same binding powers as Parser: an
+// operator on the stack is applied when the incoming operator's left binding
+// power is below its right binding power, which is exactly where
+// Parser::parse_operand returns from the recursion. Results and errors match
+// parsing and then evaluating, except that an evaluation error can be
+// reported before a syntax error further along the input.
+template <typename N>
+struct StreamEvaluator {
+  using Value = typename N::Value;
+
+  struct Frame {
+    enum class Kind { Paren, Prefix, Infix } kind;
+    Op op;
+    u8 right_bp;
+    // of the operator, for errors
+    usize offset = NOWHERE;
+  };
+
+  const N& num;
+  const std::unordered_map<string, Value>& bindings;
+  vector<Value> values {};
+  vector<Frame> frames {};
+  bool expect_operand = true;
+
+  // Applies pending operators that bind tighter than an incoming left binding power of bp
+  void reduce(u8 bp) {
+    while (!frames.empty() && frames.back().kind != Frame::Kind::Paren && bp < frames.back().right_bp) {
+      Frame frame = frames.back();
+      frames.pop_back();
+      Value right = std::move(values.back());
+      values.pop_back();
+      try {
+        if (frame.kind == Frame::Kind::Prefix) {
+          values.push_back(frame.op.eval(num, std::move(right)));
+        } else {
+          values.back() = frame.op.eval(num, std::move(values.back()), std::move(right));
+        }
+      } catch (const std::runtime_error&) {
+        rethrow_at(frame.offset);
+      }
+    }
+  }
+
+  void feed(const Token& tok) {
+    using Parse = Parser<N>;
+    if (expect_operand) {
+      switch (tok.kind) {
+        case Token::Kind::Num:
+          values.push_back(num.literal(tok.text));
+          expect_operand = false;
+          return;
+        case Token::Kind::Ident: {
+          auto it = bindings.find(string(tok.text));
+          if (it == bindings.end()) throw std::runtime_error(format("No value given for variable '{}'", tok.text));
+          values.push_back(it->second);
+          expect_operand = false;
+          return;
+        }
+        case Token::Kind::LParen:
+          frames.push_back({Frame::Kind::Paren, Op::Kind::Add, 0});
+          return;
+        case Token::Kind::Op: {
+          auto bp_opt = tok.op.prefix_binding_power();
+          if (!bp_opt.has_value()) throw std::runtime_error(format("Invalid unary operator '{}' {}", tok.op.symbol(), Parse::where(tok)));
+          frames.push_back({Frame::Kind::Prefix, tok.op, bp_opt.value().second, tok.offset});
+          return;
+        }
+        default: throw std::runtime_error(format("Unexpected token \"{}\" {}", tok.str(), Parse::where(tok)));
+      }
+    }
+
+    if (tok.kind == Token::Kind::RParen) {
+      reduce(0);
+      if (frames.empty()) throw std::runtime_error(format("Unbalanced brackets {}!", Parse::where(tok)));
+      frames.pop_back();
+      return;
+    }
+    if (tok.kind != Token::Kind::Op) throw std::runtime_error(format("Expected operator, got \"{}\" {}!", tok.str(), Parse::where(tok)));
+
+    auto op = tok.op;
+    if (auto power = op.postfix_binding_power(); power.has_value()) {
+      reduce(power.value().first);
+      try {
+        values.back() = op.eval(num, std::move(values.back()));
+      } catch (const std::runtime_error&) {
+        rethrow_at(tok.offset);
+      }
+    }
+    if (auto power = op.infix_binding_power(); power.has_value()) {
+      auto [l_bp, r_bp] = power.value();
+      reduce(l_bp);
+      frames.push_back({Frame::Kind::Infix, op, r_bp, tok.offset});
+      expect_operand = true;
+    }
+  }
+
+  Value finish() {
+    Token eof {};
+    if (expect_operand) throw std::runtime_error(format("Unexpected token \"{}\" {}", eof.str(), Parser<N>::where(eof)));
+    reduce(0);
+    if (!frames.empty()) throw std::runtime_error(format("Expected ')' {}", Parser<N>::where(eof)));
+    return std::move(values.back());
+  }
+};
+
+template <typename N>
+typename N::Value eval_stream(const N& num, int fd, const std::unordered_map<string, typename N::Value>& bindings,
+                              usize chunk_size = 1 << 16) {
+  StreamEvaluator<N> evaluator {.num = num, .bindings = bindings};
+  for_each_window(fd, chunk_size, [&](std::span<const u8> window, usize offset) {
+    Tokenizer tokenizer(window);
+    tokenizer.base = offset;
+    while (true) {
+      Token tok = tokenizer.next();
+      if (tok.kind == Token::Kind::None) break;
+      evaluator.feed(tok);
+    }
+  });
+  return evaluator.finish();
+}
+//== end streaming evaluation }}}
+
+//== Parallel tokenization ===== {{{
+// Splits a large input into about 4 chunks per thread and tokenizes them at
+// the same time. Each cut is moved back to a token boundary (see ends_token),
+// so no literal or whitespace run straddles two chunks and each chunk
+// tokenizes exactly as it does as part of the whole. Offsets are those in the
+// whole input, and the error reported is the first one in it.
+vector<Token> tokenize_parallel(std::span<const u8> stream, WorkStealingPool& pool) {
+  static constexpr usize CUTOFF = 1 << 20;
+  if (pool.size() == 1 || stream.size() < CUTOFF) return Tokenizer(stream).tokenize();
+
+  usize count = pool.size() * 4;
+  vector<usize> cuts {0};
+  for (usize c = 1; c < count; c++) {
+    // a chunk that is all one token is merged into the next
+    usize cut = token_boundary(stream.first(stream.size() * c / count));
+    if (cut > cuts.back()) cuts.push_back(cut);
+  }
+  cuts.push_back(stream.size());
+
+  usize chunks = cuts.size() - 1;
+  vector<vector<Token>> parts(chunks);
+  vector<std::exception_ptr> errors(chunks);
+  auto tokenize_chunk = [&](usize k) {
+    Tokenizer tokenizer(stream.subspan(cuts[k], cuts[k + 1] - cuts[k]));
+    tokenizer.base = cuts[k];
+    try {
+      parts[k] = tokenizer.tokenize();
+    } catch (...) {
+      errors[k] = std::current_exception();
+    }
+  };
+  WorkStealingPool::Join join;
+  for (usize k = 1; k < chunks; k++) pool.fork(join, [&, k] { tokenize_chunk(k); });
+  tokenize_chunk(0);
+  pool.wait(join);
+
+  usize total = 0;
+  for (usize k = 0; k < chunks; k++) {
+    if (errors[k]) std::rethrow_exception(errors[k]);
+    total += parts[k].size();
+  }
+  vector<Token> tokens;
+  tokens.reserve(total);
+  // Token has const members, so it can be copied but not assigned
+  for (const auto& part: parts) {
+    for (const auto& tok: part) tokens.push_back(tok);
+  }
+  return tokens;
+}
+//== end parallel tokenization }}}
+
+//== Batch pipeline ===== {{{
+// Evaluates one expression per input line. Reading and tokenizing, parsing,
+// and evaluating run as three stages on their own threads, connected by
+// bounded queues that carry batches of rows.
+
+// A bounded single-producer, single-consumer queue without locks. push waits
+// while the queue is full, so a stage that runs ahead is held back by the
+// next one.
+template <typename T>
+class SpscQueue {
+public:
+  explicit SpscQueue(usize capacity): slots(std::bit_ceil(std::max<usize>(capacity, 1))) {}
+
+  void push(T item) {
+    usize t = tail.load(std::memory_order_relaxed);
+    for (usize spins = 0; t - head.load(std::memory_order_acquire) == slots.size(); spins++) backoff(spins);
+    slots[t & (slots.size() - 1)] = std::move(item);
+    tail.store(t + 1, std::memory_order_release);
+  }
+
+  // Nothing once the queue is closed and empty
+  optional<T> pop() {
+    usize h = head.load(std::memory_order_relaxed);
+    for (usize spins = 0; h == tail.load(std::memory_order_acquire); spins++) {
+      // everything pushed before close is visible once closed is
+      if (closed.load(std::memory_order_acquire) && h == tail.load(std::memory_order_acquire)) return {};
+      backoff(spins);
+    }
+    T item = std::move(slots[h & (slots.size() - 1)]);
+    head.store(h + 1, std::memory_order_release);
+    return item;
+  }
+
+  // Called by the producer after its last push
+  void close() { closed.store(true, std::memory_order_release); }
+
+private:
+  static void backoff(usize spins) {
+    if (spins < 64) std::this_thread::yield();
+    else std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+
+  vector<T> slots;
+  // producer and consumer positions, on separate cache lines
+  alignas(64) std::atomic<usize> head = 0;
+  alignas(64) std::atomic<usize> tail = 0;
+  std::atomic<bool> closed = false;
+};
+
+// Consecutive input lines on their way through the pipeline. Tokens point
+// into text, so a batch is only ever moved by pointer.
+template <typename N>
+struct Batch {
+  static constexpr usize ROWS = 256;
+
+  string text;
+  // [begin, end) of each row in text
+  vector<pair<usize, usize>> rows;
+  vector<vector<Token>> tokens;
+  vector<unique_ptr<Expr<N>>> exprs;
+  vector<vector<string>> variables;
+  // The first error of each row, empty if there is none
+  vector<string> errors;
+
+  string_view row(usize r) const { return string_view(text).substr(rows[r].first, rows[r].second - rows[r].first); }
+};
+
+// Tokenizes up to LANES short rows side by side. The rows are transposed so
+// that byte i of every row is contiguous, every byte is classified with a
+// table, and each step of the tokenizer's state machine is applied to all
+// lanes at once. Only emitting the tokens is done row by row. Tokens carry
+// lexemes, not values, so literals are left for the backend to read.
+namespace lanes {
+  constexpr usize LANES = 16;
+  // Longest row handled here, so that every position up to the end of a
+  // row fits in a u64 mask; longer ones go through Tokenizer
+  constexpr usize WIDTH = 63;
+
+  // EXP is an e or E that starts a valid exponent and DOT a '.' before a
+  // digit; both are only known once the next bytes are looked at, and are
+  // LETTER and OTHER otherwise. E_LETTER only appears before that.
+  enum Class : u8 { END, SPACE, DIGIT, UNDERSCORE, LETTER, E_LETTER, EXP, SIGN, OP, PAREN, DOT, OTHER, CLASSES };
+
+  // Where Tokenizer would be after a byte: between tokens, inside a number
+  // (the states up to EXP_DIGITS), an identifier or a one-byte token
+  enum State : u8 { NONE, INT, DOT_SEEN, FRAC, E_SEEN, E_SIGN, EXP_DIGITS, IDENT, SINGLE, ERROR, STATES };
+
+  constexpr std::array<u8, 256> BYTE_CLASSES = [] {
+    std::array<u8, 256> res{};
+    for (usize c = 0; c < res.size(); c++) {
+      res[c] = is_space(c) ? SPACE : is_digit(c) ? DIGIT : c == '_' ? UNDERSCORE
+             : c == 'e' || c == 'E' ? E_LETTER : is_ident_start(c) ? LETTER : OTHER;
+    }
+    #define X(op, sym, _0, _1, _2) res[(#sym)[0]] = OP;
+    OP_LIST
+    #undef X
+    res['+'] = res['-'] = SIGN;
+    res['('] = res[')'] = PAREN;
+    res['.'] = DOT;
+    return res;
+  }();
+
+  // Same grammar as Tokenizer::read_number and read_ident
+  constexpr std::array<u8, usize(STATES) * CLASSES> TRANSITIONS = [] {
+    std::array<u8, usize(STATES) * CLASSES> res{};
+    for (u8 c = 0; c < CLASSES; c++) {
+      // a byte that does not continue the current token
+      u8 fresh = c == END || c == SPACE ? NONE : c == DIGIT ? INT
+               : c == UNDERSCORE || c == LETTER || c == EXP ? IDENT
+               : c == SIGN || c == OP || c == PAREN ? SINGLE : ERROR;
+      for (u8 s = 0; s < STATES; s++) res[s * CLASSES + c] = fresh;
+      res[usize(ERROR) * CLASSES + c] = ERROR;
+    }
+    auto set = [&](State from, std::initializer_list<Class> classes, State to) {
+      for (Class c: classes) res[usize(from) * CLASSES + c] = to;
+    };
+    set(INT, {DIGIT, UNDERSCORE}, INT);
+    set(INT, {DOT}, DOT_SEEN);
+    set(INT, {EXP}, E_SEEN);
+    set(DOT_SEEN, {DIGIT}, FRAC);
+    set(FRAC, {DIGIT, UNDERSCORE}, FRAC);
+    set(FRAC, {EXP}, E_SEEN);
+    set(E_SEEN, {SIGN}, E_SIGN);
+    set(E_SEEN, {DIGIT}, EXP_DIGITS);
+    set(E_SIGN, {DIGIT}, EXP_DIGITS);
+    set(EXP_DIGITS, {DIGIT, UNDERSCORE}, EXP_DIGITS);
+    set(IDENT, {DIGIT, UNDERSCORE, LETTER, EXP}, IDENT);
+    return res;
+  }();
+
+  // TRANSITIONS with the state in the low bits and flags for whether the
+  // byte starts a token, ends the one before it or is the first invalid one
+  constexpr u8 STATE_MASK = 0xf, START_BIT = 4, END_BIT = 5, ERROR_BIT = 6;
+  constexpr std::array<u8, usize(STATES) * CLASSES> STEPS = [] {
+    std::array<u8, usize(STATES) * CLASSES> res{};
+    for (usize k = 0; k < res.size(); k++) {
+      u8 before = k / CLASSES, after = TRANSITIONS[k];
+      bool start = after == SINGLE || (after == INT && before != INT) || (after == IDENT && before != IDENT);
+      bool end = before != NONE && before != ERROR && (start || after == NONE || after == ERROR);
+      bool error = after == ERROR && before != ERROR;
+      res[k] = after | start << START_BIT | end << END_BIT | error << ERROR_BIT;
+    }
+    return res;
+  }();
+
+  // Tokenizes rows[k] into tokens[k], or sets errors[k] to the message
+  // Tokenizer would throw. Every row must be at most WIDTH bytes.
+  inline void tokenize(std::span<const string_view> rows, std::span<vector<Token>> tokens, std::span<string> errors) {
+    assert(rows.size() <= LANES);
+    usize width = 0;
+    for (auto row: rows) width = std::max(width, row.size());
+
+    // transposed classes with two bytes of END after every row for the lookahead
+    u8 classes[WIDTH + 2][LANES];
+    std::memset(classes, END, (width + 2) * LANES);
+    for (usize l = 0; l < rows.size(); l++) {
+      for (usize i = 0; i < rows[l].size(); i++) classes[i][l] = BYTE_CLASSES[(u8)rows[l][i]];
+    }
+
+    for (usize i = 0; i < width; i++) {
+      for (usize l = 0; l < LANES; l++) {
+        u8 c = classes[i][l], next = classes[i + 1][l];
+        bool exponent = next == DIGIT || (next == SIGN && classes[i + 2][l] == DIGIT);
+        classes[i][l] = c == E_LETTER ? u8(exponent ? EXP : LETTER) : c == DOT && next != DIGIT ? u8(OTHER) : c;
+      }
+    }
+
+    // bit i of each mask is set where a token starts, where one ends, and
+    // where the row stops being valid
+    u64 starts[LANES] {}, ends[LANES] {}, failed[LANES] {};
+    u8 states[LANES] {};
+    for (usize i = 0; i <= width; i++) {
+      for (usize l = 0; l < LANES; l++) {
+        u8 step = STEPS[states[l] * CLASSES + classes[i][l]];
+        states[l] = step & STATE_MASK;
+        starts[l] |= u64(step >> START_BIT & 1) << i;
+        ends[l] |= u64(step >> END_BIT & 1) << i;
+        failed[l] |= u64(step >> ERROR_BIT & 1) << i;
+      }
+    }
+
+    for (usize l = 0; l < rows.size(); l++) {
+      auto row = rows[l];
+      if (failed[l]) {
+        usize i = std::countr_zero(failed[l]);
+        errors[l] = Tokenizer::unexpected(row[i], i).what();
+        continue;
+      }
+      tokens[l].reserve(std::popcount(starts[l]));
+      // tokens do not nest, so the n-th start goes with the n-th end
+      for (u64 s = starts[l], e = ends[l]; s; s &= s - 1, e &= e - 1) {
+        usize begin = std::countr_zero(s), end = std::countr_zero(e);
+        string_view text = row.substr(begin, end - begin);
+        u8 c = BYTE_CLASSES[(u8)text[0]];
+        Token tok = c == DIGIT ? Token(text)
+                  : c == PAREN ? Token((u8)text[0])
+                  : c == SIGN || c == OP ? Token(Op::from_symbol(text[0]).value())
+                  : Token(text, Token::Kind::Ident);
+        tok.offset = begin;
+        tokens[l].push_back(tok);
+      }
+    }
+  }
+}
+
+// Reads lines from fd into batches of Batch::ROWS rows and tokenizes them
+template <typename N>
+void read_batches(int fd, SpscQueue<unique_ptr<Batch<N>>>& out) {
+  auto tokenize = [](Batch<N>& batch) {
+    batch.tokens.resize(batch.rows.size());
+    batch.errors.resize(batch.rows.size());
+    // short rows go through lanes::tokenize, LANES at a time, ordered by
+    // length so that the rows sharing a call are about as long as each other
+    vector<usize> short_rows;
+    for (usize r = 0; r < batch.rows.size(); r++) {
+      if (batch.row(r).size() <= lanes::WIDTH) {
+        short_rows.push_back(r);
+        continue;
+      }
+      try {
+        batch.tokens[r] = Tokenizer(batch.row(r)).tokenize();
+      } catch (const std::runtime_error& e) {
+        batch.errors[r] = e.what();
+      }
+    }
+    std::stable_sort(short_rows.begin(), short_rows.end(), [&](usize a, usize b) { return batch.row(a).size() < batch.row(b).size(); });
+    for (usize k = 0; k < short_rows.size(); k += lanes::LANES) {
+      usize n = std::min(lanes::LANES, short_rows.size() - k);
+      string_view rows[lanes::LANES];
+      vector<Token> tokens[lanes::LANES];
+      string errors[lanes::LANES];
+      for (usize l = 0; l < n; l++) rows[l] = batch.row(short_rows[k + l]);
+      lanes::tokenize({rows, n}, {tokens, n}, {errors, n});
+      for (usize l = 0; l < n; l++) {
+        batch.tokens[short_rows[k + l]] = std::move(tokens[l]);
+        batch.errors[short_rows[k + l]] = std::move(errors[l]);
+      }
+    }
+  };
+
+  auto batch = make_unique<Batch<N>>();
+  // start of the current row in batch->text
+  usize start = 0;
+  char buf[1 << 16];
+  isize n;
+  while ((n = read(fd, buf, sizeof buf)) > 0) {
+    usize scan = batch->text.size();
+    batch->text.append(buf, n);
+    usize nl;
+    while ((nl = batch->text.find('\n', scan)) != string::npos) {
+      batch->rows.emplace_back(start, nl);
+      start = scan = nl + 1;
+      if (batch->rows.size() < Batch<N>::ROWS) continue;
+      // the rest of the text starts the next batch
+      auto next = make_unique<Batch<N>>();
+      next->text = batch->text.substr(start);
+      batch->text.resize(start);
+      tokenize(*batch);
+      out.push(std::move(batch));
+      batch = std::move(next);
+      start = scan = 0;
+    }
+  }
+  if (n < 0) throw std::runtime_error(format("Cannot read input: {}", std::strerror(errno)));
+  if (start < batch->text.size()) batch->rows.emplace_back(start, batch->text.size());
+  if (!batch->rows.empty()) {
+    tokenize(*batch);
+    out.push(std::move(batch));
+  }
+}
+
+template <typename N>
+void parse_batches(const N& num, bool fold_constants, SpscQueue<unique_ptr<Batch<N>>>& in, SpscQueue<unique_ptr<Batch<N>>>& out) {
+  while (auto batch = in.pop()) {
+    auto& b = *batch.value();
+    b.exprs.resize(b.rows.size());
+    b.variables.resize(b.rows.size());
+    for (usize r = 0; r < b.rows.size(); r++) {
+      if (!b.errors[r].empty()) continue;
+      Parser<N> p {.num = num, .tokens = std::move(b.tokens[r]), .fold_constants = fold_constants};
+      try {
+        b.exprs[r] = p.parse_expr();
+        b.variables[r] = std::move(p.variables);
+      } catch (const std::runtime_error& e) {
+        b.errors[r] = e.what();
+      }
+    }
+    out.push(std::move(batch.value()));
+  }
+}
+//== end batch pipeline }}}
+
+//== Syntax check ===== {{{
+// Validates an expression without tokenizing it into Tokens, parsing or
+// throwing. Whether an expression is well formed only depends on where each
+// operator may appear (prefix, infix, postfix), not on the binding powers
+// themselves, so this is a single pass over the bytes with a table lookup per
+// byte. Literals are checked against the tokenizer's grammar only; whether
+// the backend can represent them (overflow, decimals in an integer backend)
+// is left to evaluation.
+
+namespace syntax {
+  enum : u8 {
+    SPACE   = 1 << 0,
+    DIGIT   = 1 << 1,
+    IDENT   = 1 << 2, // can start an identifier
+    LPAREN  = 1 << 3,
+    RPAREN  = 1 << 4,
+    PREFIX  = 1 << 5,
+    INFIX   = 1 << 6,
+    POSTFIX = 1 << 7,
+  };
+
+  constexpr std::array<u8, 256> CLASSES = [] {
+    std::array<u8, 256> res{};
+    for (usize c = 0; c < res.size(); c++) {
+      if (is_space(c)) res[c] |= SPACE;
+      if (is_digit(c)) res[c] |= DIGIT;
+      if (is_ident_start(c)) res[c] |= IDENT;
+    }
+    res['('] |= LPAREN;
+    res[')'] |= RPAREN;
+    #define X(op, sym, _0, _1, _2) \
+      if (Op(Op::Kind::op).prefix_binding_power().has_value()) res[(#sym)[0]] |= PREFIX; \
+      if (Op(Op::Kind::op).infix_binding_power().has_value()) res[(#sym)[0]] |= INFIX; \
+      if (Op(Op::Kind::op).postfix_binding_power().has_value()) res[(#sym)[0]] |= POSTFIX;
+    OP_LIST
+    #undef X
+    return res;
+  }();
+
+  constexpr bool has(u8 c, u8 cls) { return (CLASSES[c] & cls) != 0; }
+}
+
+// Offset of the first syntax error, or nullopt if the expression is well
+// formed. Errors at the end of the input (a missing operand or ')') are
+// reported at the input's length.
+optional<usize> check_syntax(std::span<const u8> src) {
+  using namespace syntax;
+  usize n = src.size(), i = 0, depth = 0;
+  bool operand = true;
+
+  auto skip = [&](u8 cls) {
+    while (i < n && has(src[i], cls)) i++;
+  };
+
+  while (i < n) {
+    u8 c = src[i];
+    if (has(c, SPACE)) {
+      i++;
+      continue;
+    }
+    if (operand) {
+      if (has(c, DIGIT)) {
+        // same grammar as Tokenizer::read_number
+        auto digit_at = [&](usize j) { return j < n && is_digit(src[j]); };
+        auto skip_digits = [&] { while (i < n && (is_digit(src[i]) || src[i] == '_')) i++; };
+        skip_digits();
+        if (i < n && src[i] == '.' && digit_at(i + 1)) {
+          i++;
+          skip_digits();
+        }
+        if (i < n && (src[i] == 'e' || src[i] == 'E')) {
+          usize sign = (i + 1 < n && (src[i + 1] == '+' || src[i + 1] == '-')) ? 1 : 0;
+          if (digit_at(i + 1 + sign)) {
+            i += 1 + sign;
+            skip_digits();
+          }
+        }
+        operand = false;
+      } else if (has(c, IDENT)) {
+        skip(IDENT | DIGIT);
+        operand = false;
+      } else if (has(c, LPAREN)) {
+        depth++;
+        i++;
+      } else if (has(c, PREFIX)) {
+        i++;
+      } else {
+        return i;
+      }
+    } else {
+      if (has(c, RPAREN)) {
+        if (depth == 0) return i;
+        depth--;
+      } else if (has(c, INFIX)) {
+        operand = true;
+      } else if (!has(c, POSTFIX)) {
+        return i;
+      }
+      i++;
+    }
+  }
+  if (operand || depth != 0) return n;
+  return {};
+}
+
+optional<usize> check_syntax(string_view src) {
+  return check_syntax(std::span<const u8>((const u8*)src.data(), src.size()));
+}
+//== end syntax check }}}
+
+//== Rewriting ===== {{{
+// Rule-driven simplification of Expr trees. A rule looks at a single node and
+// replaces it if it matches. A pass applies its rules bottom-up, repeating on
+// each node until none matches, and the pass manager runs the passes in order
+// and records what each of them did.
+//
+// Rewrites never change a result, but can drop an error the original would
+// have raised: -(-x) no longer overflows when x is the minimum i64.
+
+// Rewrites node in place and returns true if it matched
+template <typename N>
+using Rule = bool (*)(const N& num, unique_ptr<Expr<N>>& node);
+
+namespace rules {
+  // Whether x equals k. Compared through the backend's printed form so that
+  // e.g. 2 mod 2 does not count as 2, and through the integer a residue
+  // stands for, so that 5 mod 3 does not count as 2 in an exponent.
+  template <typename N>
+  bool is_value(const N& num, const typename N::Value& x, string_view k) {
+    if (num.str(x) != k) return false;
+    if constexpr (requires { num.integer(x); }) {
+      auto n = num.integer(x);
+      return n.has_value() && format("{}", n.value()) == k;
+    }
+    return true;
+  }
+
+  template <typename N>
+  bool is_int(const N& num, const unique_ptr<Expr<N>>& node, string_view k) {
+    return node->kind == Expr<N>::Kind::Literal && is_value(num, node->literal, k);
+  }
+
+  template <typename N>
+  bool is_var(const unique_ptr<Expr<N>>& node) {
+    return node->kind == Expr<N>::Kind::Variable;
+  }
+
+  // IEEE -0 + 0 is +0, so x + 0 is not x
+  template <typename N>
+  constexpr bool has_signed_zero = std::is_floating_point_v<typename N::Value>;
+
+  // An operator applied to literals becomes a literal, unless evaluating it throws
+  template <typename N>
+  bool constants(const N& num, unique_ptr<Expr<N>>& node) {
+    using E = Expr<N>;
+    try {
+      if (node->kind == E::Kind::Unary && node->unary.expr->kind == E::Kind::Literal) {
+        node = E::Literal(node->unary.op.eval(num, node->unary.expr->literal));
+        return true;
+      }
+      if (node->kind == E::Kind::Binary && node->binary.left->kind == E::Kind::Literal &&
+          node->binary.right->kind == E::Kind::Literal) {
+        node = E::Literal(node->binary.op.eval(num, node->binary.left->literal, node->binary.right->literal));
+        return true;
+      }
+    } catch (const std::runtime_error&) {}
+    if (node->kind != E::Kind::Nary) return false;
+
+    // A chain folds its leading literals, in order, up to the first operand
+    // that is not one or the first step that throws
+    auto& [op, operands, offsets] = node->nary;
+    usize n = 0;
+    while (n < operands.size() && operands[n]->kind == E::Kind::Literal) n++;
+    if (n < 2) return false;
+    typename N::Value acc = operands[0]->literal;
+    usize folded = 1;
+    for (; folded < n; folded++) {
+      try {
+        acc = op.eval(num, acc, operands[folded]->literal);
+      } catch (const std::runtime_error&) {
+        break;
+      }
+    }
+    if (folded == 1) return false;
+    vector<unique_ptr<E>> rest;
+    rest.push_back(E::Literal(std::move(acc)));
+    for (usize i = folded; i < operands.size(); i++) rest.push_back(std::move(operands[i]));
+    // each operand keeps the operator before it
+    if (!offsets.empty()) offsets.erase(offsets.begin() + 1, offsets.begin() + folded);
+    node = E::Chain(op, std::move(rest), std::move(offsets));
+    return true;
+  }
+
+  // +x, x+0, 0+x, x-0, x*1, 1*x, x/1, x^1 -> x
+  template <typename N>
+  bool identity(const N& num, unique_ptr<Expr<N>>& node) {
+    using E = Expr<N>;
+    if (node->kind == E::Kind::Unary && node->unary.op.kind == Op::Kind::Add) {
+      auto x = std::move(node->unary.expr);
+      node = std::move(x);
+      return true;
+    }
+    if (node->kind == E::Kind::Nary) {
+      // a chain drops its 0s (for +) or 1s (for *), but keeps at least one operand
+      auto& [op, operands, offsets] = node->nary;
+      if (op.kind == Op::Kind::Add && has_signed_zero<N>) return false;
+      string_view k = op.kind == Op::Kind::Add ? "0" : "1";
+      if (std::none_of(operands.begin(), operands.end(), [&](const auto& e) { return is_int(num, e, k); })) return false;
+      // each operand keeps the operator before it
+      vector<unique_ptr<E>> rest;
+      vector<usize> kept;
+      for (usize i = 0; i < operands.size(); i++) {
+        if (is_int(num, operands[i], k)) continue;
+        rest.push_back(std::move(operands[i]));
+        if (!offsets.empty()) kept.push_back(offsets[i]);
+      }
+      if (rest.empty()) rest.push_back(E::Literal(num.literal(k)));
+      if (kept.size() != rest.size()) kept.clear();
+      node = E::Chain(op, std::move(rest), std::move(kept));
+      return true;
+    }
+    if (node->kind != E::Kind::Binary) return false;
+    auto& [op, left, right] = node->binary;
+    bool keep_left = false, keep_right = false;
+    switch (op.kind) {
+      case Op::Kind::Add:
+        keep_left = !has_signed_zero<N> && is_int(num, right, "0");
+        keep_right = !has_signed_zero<N> && is_int(num, left, "0");
+        break;
+      case Op::Kind::Sub: keep_left = is_int(num, right, "0"); break;
+      case Op::Kind::Mul:
+        keep_left = is_int(num, right, "1");
+        keep_right = is_int(num, left, "1");
+        break;
+      case Op::Kind::Div:
+      case Op::Kind::Exp: keep_left = is_int(num, right, "1"); break;
+      default: break;
+    }
+    if (!keep_left && !keep_right) return false;
+    auto x = std::move(keep_left ? left : right);
+    node = std::move(x);
+    return true;
+  }
+
+  // -(-x) -> x
+  template <typename N>
+  bool double_negation(const N&, unique_ptr<Expr<N>>& node) {
+    using E = Expr<N>;
+    auto is_neg = [](const unique_ptr<E>& e) { return e->kind == E::Kind::Unary && e->unary.op.kind == Op::Kind::Sub; };
+    if (!is_neg(node) || !is_neg(node->unary.expr)) return false;
+    auto x = std::move(node->unary.expr->unary.expr);
+    node = std::move(x);
+    return true;
+  }
+
+  // x^2 -> x*x, x*2 and 2*x -> x+x. Only for variables, so that no subtree is
+  // evaluated twice, and only where + and * cannot fail: a fixed width
+  // integer overflows on x*2 exactly when it does on x+x, but the error would
+  // name the wrong operator.
+  template <typename N>
+  bool strength(const N& num, unique_ptr<Expr<N>>& node) {
+    using E = Expr<N>;
+    if constexpr (!N::EXACT && !std::is_floating_point_v<typename N::Value>) return false;
+    if (node->kind != E::Kind::Binary) return false;
+    auto& [op, left, right] = node->binary;
+    if (op.kind == Op::Kind::Exp && is_var(left) && is_int(num, right, "2")) {
+      node = node->placed(make_unique<E>(Op::Kind::Mul, left->clone(), left->clone()));
+      return true;
+    }
+    if (op.kind == Op::Kind::Mul && is_var(left) && is_int(num, right, "2")) {
+      node = node->placed(make_unique<E>(Op::Kind::Add, left->clone(), left->clone()));
+      return true;
+    }
+    if (op.kind == Op::Kind::Mul && is_int(num, left, "2") && is_var(right)) {
+      node = node->placed(make_unique<E>(Op::Kind::Add, right->clone(), right->clone()));
+      return true;
+    }
+    return false;
+  }
+}
+
+// Canonical form for the commutative operators + and *, so that expressions
+// that differ only in operand order get the same tree and the same hash.
+// With an EXACT backend a chain like 2*x*3 is flattened into one n-ary node,
+// its constants are combined (6*x) and its operands are sorted by structural
+// hash, constant first. Otherwise regrouping could round or overflow
+// differently, so only the first two operands of each node are put in order,
+// and fixed width integers combine constants only where no overflow moves.
+// Each node's hash is built from its children's as the pass returns, so the
+// tree is hashed once. Returns the number of nodes whose subtree changed.
+struct Canonical {
+  usize rewrites = 0;
+  // of the canonical subtree, as Expr::hash
+  u64 hash = 0;
+};
+
+template <typename N>
+Canonical canonical(const N& num, unique_ptr<Expr<N>>& node) {
+  using E = Expr<N>;
+  if (node->kind == E::Kind::Unary) {
+    auto c = canonical(num, node->unary.expr);
+    return {c.rewrites, E::unary_hash(node->unary.op, c.hash)};
+  }
+  if (node->kind == E::Kind::Nary && !N::EXACT) {
+    // (a op b) op c ... with a and b swapped is the same computation
+    auto& [op, operands, offsets] = node->nary;
+    usize count = 0;
+    vector<u64> hashes;
+    for (auto& e: operands) {
+      auto c = canonical(num, e);
+      count += c.rewrites;
+      hashes.push_back(c.hash);
+    }
+    if constexpr (!N::EXACT && !std::is_floating_point_v<typename N::Value>) {
+      // With fixed width integers, the constants of a chain with one other
+      // operand x combine (2*x*3 -> 6*x) if they fit and all have the same
+      // sign, positive for *: each partial result is then between 0 and the
+      // last one, so one overflows exactly when 6*x does.
+      usize other = operands.size();
+      bool nonnegative = true, nonpositive = true, positive = true;
+      for (usize i = 0; i < operands.size(); i++) {
+        if (operands[i]->kind != E::Kind::Literal) {
+          other = other == operands.size() ? i : NOWHERE;
+          continue;
+        }
+        const auto& c = operands[i]->literal;
+        nonnegative = nonnegative && c >= 0;
+        nonpositive = nonpositive && c <= 0;
+        positive = positive && c > 0;
+      }
+      bool same_sign = op.kind == Op::Kind::Add ? nonnegative || nonpositive : positive;
+      if (other < operands.size() && same_sign && operands.size() > 2) {
+        optional<typename N::Value> constant;
+        try {
+          for (const auto& e: operands) {
+            if (e->kind != E::Kind::Literal) continue;
+            constant = constant.has_value() ? op.eval(num, constant.value(), e->literal) : e->literal;
+          }
+        } catch (const std::runtime_error&) {
+          constant.reset();
+        }
+        if (constant.has_value()) {
+          // an overflow is reported at the last operator, where the result of the whole chain is formed
+          usize at = offsets.empty() ? NOWHERE : offsets.back();
+          vector<unique_ptr<E>> rest;
+          rest.push_back(E::Literal(std::move(constant.value())));
+          rest.push_back(std::move(operands[other]));
+          node = E::Chain(op, std::move(rest), {NOWHERE, at});
+          auto c = canonical(num, node);
+          return {count + c.rewrites + 1, c.hash};
+        }
+      }
+    }
+    if (hashes[1] < hashes[0]) {
+      std::swap(operands[0], operands[1]);
+      std::swap(hashes[0], hashes[1]);
+      count++;
+    }
+    u64 h = E::chain_hash(op);
+    for (u64 x: hashes) h = hash_mix(h, x);
+    return {count, h};
+  }
+  if (node->kind != E::Kind::Binary && node->kind != E::Kind::Nary) return {0, node->leaf_hash(num)};
+
+  Op op = node->kind == E::Kind::Binary ? node->binary.op : node->nary.op;
+  bool commutative = op.kind == Op::Kind::Add || op.kind == Op::Kind::Mul;
+  if (!commutative || !N::EXACT) {
+    auto l = canonical(num, node->binary.left), r = canonical(num, node->binary.right);
+    usize count = l.rewrites + r.rewrites;
+    if (commutative && r.hash < l.hash) {
+      std::swap(node->binary.left, node->binary.right);
+      std::swap(l, r);
+      count++;
+    }
+    return {count, E::binary_hash(op, l.hash, r.hash)};
+  }
+
+  // flatten the chain of `op` nodes into its operands, in order
+  vector<unique_ptr<E>> operands, pending;
+  pending.push_back(std::move(node));
+  // whether a chain other than node itself was flattened into it
+  bool nested = false;
+  for (bool root = true; !pending.empty(); root = false) {
+    auto e = std::move(pending.back());
+    pending.pop_back();
+    if (e->kind == E::Kind::Binary && e->binary.op.kind == op.kind) {
+      pending.push_back(std::move(e->binary.right));
+      pending.push_back(std::move(e->binary.left));
+    } else if (e->kind == E::Kind::Nary && e->nary.op.kind == op.kind) {
+      for (auto it = e->nary.operands.rbegin(); it != e->nary.operands.rend(); ++it) pending.push_back(std::move(*it));
+    } else {
+      operands.push_back(std::move(e));
+      continue;
+    }
+    nested = nested || !root;
+  }
+
+  // The subtree changed if an operand's did, or the node absorbed nested
+  // chains, combined or dropped constants, or reordered its operands
+  usize count = 0;
+  optional<typename N::Value> constant;
+  usize literals = 0, first_literal = 0;
+  struct Keyed {
+    u64 hash;
+    usize index;
+    unique_ptr<E> expr;
+  };
+  vector<Keyed> keyed;
+  for (usize i = 0; i < operands.size(); i++) {
+    auto& e = operands[i];
+    auto c = canonical(num, e);
+    count += c.rewrites;
+    if (e->kind == E::Kind::Literal) {
+      // exact + and * do not throw
+      constant = constant.has_value() ? op.eval(num, std::move(constant.value()), e->literal) : e->literal;
+      if (literals++ == 0) first_literal = i;
+    } else {
+      keyed.push_back({c.hash, i, std::move(e)});
+    }
+  }
+  std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.hash < b.hash; });
+
+  // 0 + x and 1 * x
+  string_view identity = op.kind == Op::Kind::Add ? "0" : "1";
+  bool dropped = constant.has_value() && !keyed.empty() && rules::is_value(num, constant.value(), identity);
+  if (dropped) constant.reset();
+
+  bool changed = count > 0 || nested || literals > 1 || dropped || (literals == 1 && first_literal != 0);
+  vector<unique_ptr<E>> chain;
+  vector<u64> hashes;
+  if (constant.has_value()) {
+    chain.push_back(E::Literal(std::move(constant.value())));
+    hashes.push_back(chain.back()->leaf_hash(num));
+  }
+  for (usize k = 0; k < keyed.size(); k++) {
+    changed = changed || keyed[k].index != k + (literals == 1 ? 1 : 0);
+    hashes.push_back(keyed[k].hash);
+    chain.push_back(std::move(keyed[k].expr));
+  }
+  node = E::Chain(op, std::move(chain));
+
+  u64 h = hashes[0];
+  if (hashes.size() == 2) h = E::binary_hash(op, hashes[0], hashes[1]);
+  if (hashes.size() > 2) {
+    h = E::chain_hash(op);
+    for (u64 x: hashes) h = hash_mix(h, x);
+  }
+  return {count + (changed ? 1 : 0), h};
+}
+
+template <typename N>
+usize canonicalize(const N& num, unique_ptr<Expr<N>>& node) {
+  return canonical(num, node).rewrites;
+}
+
+template <typename N>
+struct Pass {
+  string name;
+  vector<Rule<N>> rules;
+  // Instead of rules, a transformation of the whole tree that returns its number of rewrites
+  usize (*transform)(const N& num, unique_ptr<Expr<N>>& expr) = nullptr;
+
+  // Returns the number of rewrites
+  usize apply(const N& num, unique_ptr<Expr<N>>& node) const {
+    using E = Expr<N>;
+    if (transform != nullptr) return transform(num, node);
+    usize count = 0;
+    switch (node->kind) {
+      case E::Kind::Unary: count += apply(num, node->unary.expr); break;
+      case E::Kind::Binary:
+        count += apply(num, node->binary.left);
+        count += apply(num, node->binary.right);
+        break;
+      case E::Kind::Nary:
+        for (auto& e: node->nary.operands) count += apply(num, e);
+        break;
+      default: break;
+    }
+    // The children are done, and a rule only ever produces a node whose
+    // children are already rewritten, so only this node needs another look
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (auto rule: rules) {
+        if (rule(num, node)) {
+          count++;
+          changed = true;
+        }
+      }
+    }
+    return count;
+  }
+};
+
+struct PassStats {
+  string name;
+  usize nodes_before = 0;
+  usize nodes_after = 0;
+  usize rewrites = 0;
+  f64 micros = 0;
+
+  string str() const {
+    return format("{:<16} {:>8} -> {:<8} nodes {:>6} rewrites {:>10.1f} us", name, nodes_before, nodes_after, rewrites, micros);
+  }
+};
+
+template <typename N>
+struct PassManager {
+  vector<Pass<N>> passes;
+
+  static PassManager standard() {
+    return {{
+      {"constants", {rules::constants<N>}},
+      {"identities", {rules::identity<N>, rules::double_negation<N>}},
+      {"canonical", {}, canonicalize<N>},
+      {"strength", {rules::strength<N>}},
+      // identities and negation can expose new constant subtrees
+      {"constants", {rules::constants<N>}},
+    }};
+  }
+
+  vector<PassStats> run(const N& num, unique_ptr<Expr<N>>& expr) const {
+    vector<PassStats> stats;
+    for (const auto& pass: passes) {
+      PassStats s {.name = pass.name, .nodes_before = expr->size()};
+      auto start = std::chrono::steady_clock::now();
+      s.rewrites = pass.apply(num, expr);
+      s.micros = std::chrono::duration<f64, std::micro>(std::chrono::steady_clock::now() - start).count();
+      s.nodes_after = expr->size();
+      stats.push_back(s);
+    }
+    return stats;
+  }
+};
+//== end rewriting }}}
+
+//== C++ generation ===== {{{
+// Turns a file of named formulas, one "name = expr" per line, into a C++
+// header with an inline function per formula, for --emit-cpp. Each formula
+// is folded and strength reduced by the standard passes first. Every
+// operation is its own statement, so operands are evaluated left to right
+// as in Expr::eval and the same error is raised. The header carries a small
+// runtime with the integer and f64 backends' arithmetic. Only those
+// backends can be emitted.
+
+// Keep in step with IntArith, powi, factorial and F64Arith
+constexpr string_view EMIT_RUNTIME = R"(#ifndef PRATT_EMIT_RUNTIME
+#define PRATT_EMIT_RUNTIME
+namespace pratt_emit {
+template <typename T>
+std::string str(T x) {
+  if constexpr (sizeof(T) <= sizeof(int64_t)) {
+    return std::to_string(x);
+  } else {
+    unsigned __int128 mag = x < 0 ? -(unsigned __int128)x : (unsigned __int128)x;
+    std::string s;
+    do {
+      s += (char)('0' + mag % 10);
+      mag /= 10;
+    } while (mag != 0);
+    if (x < 0) s += '-';
+    return {s.rbegin(), s.rend()};
+  }
+}
+
+template <typename T>
+[[noreturn]] void overflow(T l, const char* sym, T r) {
+  const char* name = sizeof(T) == 4 ? "i32" : sizeof(T) == 8 ? "i64" : "i128";
+  throw std::runtime_error(str(l) + " " + sym + " " + str(r) + " overflows " + name);
+}
+
+template <typename T>
+T neg(T x) {
+  if (x == std::numeric_limits<T>::min()) overflow<T>(0, "-", x);
+  return -x;
+}
+
+template <typename T>
+T add(T l, T r) {
+  T res;
+  if (__builtin_add_overflow(l, r, &res)) overflow(l, "+", r);
+  return res;
+}
+
+template <typename T>
+T sub(T l, T r) {
+  T res;
+  if (__builtin_sub_overflow(l, r, &res)) overflow(l, "-", r);
+  return res;
+}
+
+template <typename T>
+T mul(T l, T r) {
+  T res;
+  if (__builtin_mul_overflow(l, r, &res)) overflow(l, "*", r);
+  return res;
+}
+
+template <typename T>
+T div(T l, T r) {
+  if (r == 0) throw std::runtime_error("Division by zero");
+  if (r == -1 && l == std::numeric_limits<T>::min()) overflow(l, "/", r);
+  return l / r;
+}
+
+template <typename T>
+T pow(T x, T p) {
+  if (p < 0) throw std::runtime_error("Integer cannot be raised to negative power");
+  T b = x, res = 1;
+  for (uint64_t e = (uint64_t)p;;) {
+    if ((e & 1) && __builtin_mul_overflow(res, b, &res)) break;
+    e >>= 1;
+    if (e == 0) return res;
+    if (__builtin_mul_overflow(b, b, &b)) break;
+  }
+  throw std::runtime_error(str(x) + "^" + str(p) + " will overflow!");
+}
+
+template <typename T>
+T fact(T x) {
+  if (x < 0) throw std::runtime_error("Factorial of negative integer " + str(x) + " is not defined");
+  T res = 1;
+  for (T i = 2; i <= x; i++) {
+    if (__builtin_mul_overflow(res, i, &res)) throw std::runtime_error(str(x) + "! will overflow!");
+  }
+  return res;
+}
+
+inline double pow(double l, double r) {
+  if (r == std::trunc(r) && std::fabs(r) <= 64) {
+    double res = 1;
+    for (uint64_t p = (uint64_t)std::fabs(r); p != 0; p >>= 1) {
+      if (p & 1) res *= l;
+      l *= l;
+    }
+    return r < 0 ? 1 / res : res;
+  }
+  return std::pow(l, r);
+}
+
+inline double fact(double x) {
+  static const auto factorials = [] {
+    std::array<double, 171> res{};
+    res[0] = 1;
+    for (size_t i = 1; i < res.size(); i++) res[i] = res[i - 1] * (double)i;
+    return res;
+  }();
+  if (x >= 0 && x < factorials.size() && x == std::trunc(x)) return factorials[(size_t)x];
+  return std::tgamma(x + 1);
+}
+}
+#endif
+)";
+
+template <typename N>
+struct CppEmitter {
+  using E = Expr<N>;
+
+  const N& num;
+  // the C++ type of N::Value
+  string type;
+  string body;
+  usize temps = 0;
+
+  static constexpr string_view value_type() {
+    if constexpr (std::is_same_v<N, F64Arith>) return "double";
+    else if constexpr (std::is_same_v<N, I32Arith>) return "int32_t";
+    else if constexpr (std::is_same_v<N, I64Arith>) return "int64_t";
+    else if constexpr (std::is_same_v<N, I128Arith>) return "__int128";
+    else return "";
+  }
+  static constexpr bool SUPPORTED = !value_type().empty();
+
+  string literal(const typename N::Value& x) const {
+    if constexpr (std::is_same_v<N, F64Arith>) {
+      if (std::isnan(x)) return "std::numeric_limits<double>::quiet_NaN()";
+      if (std::isinf(x)) return x < 0 ? "-std::numeric_limits<double>::infinity()" : "std::numeric_limits<double>::infinity()";
+      string s = format("{}", x);
+      if (s.find_first_of(".e") == string::npos) s += ".0";
+      return x < 0 ? "(" + s + ")" : s;
+    } else {
+      using Unsigned = std::make_unsigned_t<typename N::Value>;
+      // any value, including the minimum and 128-bit ones, from its two's complement bits
+      Unsigned bits = (Unsigned)x;
+      if (x >= 0 && bits <= std::numeric_limits<u64>::max()) return format("{}({})", type, (u64)bits);
+      if (x < 0 && -(bits) <= (Unsigned)std::numeric_limits<i64>::max()) return format("{}(-{})", type, (u64)-bits);
+      if constexpr (sizeof(Unsigned) <= sizeof(u64)) {
+        return format("{}({:#x}ull)", type, (u64)bits);
+      } else {
+        return format("{}((unsigned __int128){:#x}ull << 64 | {:#x}ull)", type, (u64)(bits >> 64), (u64)bits);
+      }
+    }
+  }
+
+  string call(Op op, const string& l, const string& r) const {
+    if constexpr (std::is_same_v<N, F64Arith>) {
+      if (op.kind != Op::Kind::Exp) return format("{} {} {}", l, op.symbol(), r);
+    }
+    switch (op.kind) {
+      case Op::Kind::Add: return format("pratt_emit::add({}, {})", l, r);
+      case Op::Kind::Sub: return format("pratt_emit::sub({}, {})", l, r);
+      case Op::Kind::Mul: return format("pratt_emit::mul({}, {})", l, r);
+      case Op::Kind::Div: return format("pratt_emit::div({}, {})", l, r);
+      case Op::Kind::Exp: return format("pratt_emit::pow({}, {})", l, r);
+      default: throw std::runtime_error(format("Invalid infix operator '{}'. This should be unreachable", op.symbol()));
+    }
+  }
+
+  string call(Op op, const string& x) const {
+    switch (op.kind) {
+      case Op::Kind::Add: return x;
+      case Op::Kind::Sub:
+        if constexpr (std::is_same_v<N, F64Arith>) return "-" + x;
+        else return format("pratt_emit::neg({})", x);
+      case Op::Kind::Fact: return format("pratt_emit::fact({})", x);
+      default: throw std::runtime_error(format("Invalid unary operator '{}'. This should be unreachable.", op.symbol()));
+    }
+  }
+
+  // Formula variables become v_<name> and temporaries pratt_t<n>_, so that
+  // neither can collide with the other, a C++ keyword or the runtime
+  static string param(const string& name) { return "v_" + name; }
+
+  // Declares a temporary for value and returns its name
+  string temp(const string& value) {
+    string name = format("pratt_t{}_", temps++);
+    body += format("  const {} {} = {};\n", type, name, value);
+    return name;
+  }
+
+  // Emits the statements computing e and returns an expression for its value
+  string operand(const E& e) {
+    switch (e.kind) {
+      case E::Kind::None: throw std::runtime_error("Attempt to eval expr of type None");
+      case E::Kind::Literal: return literal(e.literal);
+      case E::Kind::Variable: return param(e.var.name);
+      case E::Kind::Unary: {
+        string x = operand(*e.unary.expr);
+        return e.unary.op.kind == Op::Kind::Add ? x : temp(call(e.unary.op, x));
+      }
+      case E::Kind::Binary: {
+        string l = operand(*e.binary.left);
+        string r = operand(*e.binary.right);
+        return temp(call(e.binary.op, l, r));
+      }
+      case E::Kind::Nary: {
+        string acc = operand(*e.nary.operands[0]);
+        for (usize i = 1; i < e.nary.operands.size(); i++) acc = temp(call(e.nary.op, acc, operand(*e.nary.operands[i])));
+        return acc;
+      }
+    }
+    throw std::runtime_error("Invalid expression kind. This should be unreachable.");
+  }
+};
+
+inline bool is_identifier(string_view s) {
+  return !s.empty() && is_ident_start(s[0]) && std::all_of(s.begin(), s.end(), [](u8 c) { return is_ident(c); });
+}
+
+// Calls f(name, formula) for each "name = expr" line of source, skipping
+// blank lines and # comments. Errors are prefixed with file and line.
+template <typename F>
+void for_each_formula(string_view source, string_view file, F&& f) {
+  auto trim = [](string_view s) {
+    while (!s.empty() && is_space(s.front())) s.remove_prefix(1);
+    while (!s.empty() && is_space(s.back())) s.remove_suffix(1);
+    return s;
+  };
+  std::unordered_set<string> names;
+  usize line_no = 0;
+  for (usize start = 0; start < source.size();) {
+    usize end = std::min(source.find('\n', start), source.size());
+    string_view line = trim(source.substr(start, end - start));
+    start = end + 1;
+    line_no++;
+    if (line.empty() || line[0] == '#') continue;
+
+    try {
+      usize eq = line.find('=');
+      if (eq == string_view::npos) throw std::runtime_error("expected name = expr");
+      string name(trim(line.substr(0, eq)));
+      if (!is_identifier(name)) throw std::runtime_error(format("\"{}\" is not a valid function name", name));
+      if (!names.insert(name).second) throw std::runtime_error(format("{} is defined twice", name));
+      f(name, trim(line.substr(eq + 1)));
+    } catch (const std::runtime_error& e) {
+      throw std::runtime_error(format("{}:{}: {}", file, line_no, e.what()));
+    }
+  }
+}
+
+// Formula names are the generated functions' names, so they cannot be these
+inline bool is_cpp_keyword(string_view s) {
+  static const std::unordered_set<string_view> keywords = {
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break", "case", "catch",
+    "char", "char8_t", "char16_t", "char32_t", "class", "compl", "concept", "const", "consteval", "constexpr",
+    "constinit", "const_cast", "continue", "co_await", "co_return", "co_yield", "decltype", "default", "delete",
+    "do", "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false", "float", "for",
+    "friend", "goto", "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+    "nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register", "reinterpret_cast",
+    "requires", "return", "short", "signed", "sizeof", "static", "static_assert", "static_cast", "struct",
+    "switch", "template", "this", "thread_local", "throw", "true", "try", "typedef", "typeid", "typename",
+    "union", "unsigned", "using", "virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq", "pratt_emit"};
+  return keywords.contains(s);
+}
+
+// The header for the formulas in source, read from file (named in errors)
+template <typename N>
+string emit_cpp(const N& num, string_view source, string_view file, string_view ns) {
+  if constexpr (!CppEmitter<N>::SUPPORTED) {
+    throw std::runtime_error("--emit-cpp supports the i32, i64, i128 and f64 backends");
+  } else {
+    string type(CppEmitter<N>::value_type());
+    string res = format("// Generated by pratt --emit-cpp from {}. Do not edit.\n#pragma once\n", file);
+    res += "#include <array>\n#include <cmath>\n#include <cstddef>\n#include <cstdint>\n#include <limits>\n#include <stdexcept>\n#include <string>\n\n";
+    res += EMIT_RUNTIME;
+    if (!ns.empty()) res += format("\nnamespace {} {{\n", ns);
+
+    for_each_formula(source, file, [&](const string& name, string_view formula) {
+      if (is_cpp_keyword(name)) throw std::runtime_error(format("\"{}\" is a C++ keyword", name));
+      Parser<N> p {.num = num, .tokens = Tokenizer(formula).tokenize(), .fold_constants = true};
+      auto expr = p.parse_expr();
+      PassManager<N>::standard().run(num, expr);
+
+      CppEmitter<N> emitter {.num = num, .type = type};
+      string value = emitter.operand(*expr);
+      string params;
+      for (const auto& v: p.variables) params += format("{}[[maybe_unused]] {} {}", params.empty() ? "" : ", ", type, CppEmitter<N>::param(v));
+      res += format("\n// {}\ninline {} {}({}) {{\n{}  return {};\n}}\n", formula, type, name, params, emitter.body, value);
+    });
+
+    if (!ns.empty()) res += format("}}  // namespace {}\n", ns);
+    return res;
+  }
+}
+//== end C++ generation }}}
+
+//== Compiled images ===== {{{
+// A library of compiled formulas in one file, written by --compile and used
+// in place after a single mmap. Every reference inside it is an offset from
+// the start of the file and instructions and literals are stored exactly as
+// they are laid out in memory, so loading needs no parsing and no pointer
+// fixups. In exchange an image only loads into a build with the same
+// endianness, backend and Bytecode instruction set, which the header records.
+//
+// Layout, each section starting on a 16 byte boundary:
+//   ImageHeader
+//   ImageFormula[formulas]
+//   Instr[instructions]  the fused bytecode of every formula, back to back
+//   Value[literals]      the literal pool, indexed from each formula's base
+//   u32[slots]           formulas by name hash, open addressing
+//   u32[slots]           formulas by structural hash, open addressing
+//   char[strings]        names, each formula's variables after its name
+
+constexpr std::array<char, 8> IMAGE_MAGIC = {'P', 'R', 'A', 'T', 'T', 'I', 'M', 'G'};
+// Bump when the layout below or Expr::hash changes
+constexpr u32 IMAGE_VERSION = 1;
+constexpr u32 IMAGE_EMPTY = ~u32(0);
+
+struct ImageHeader {
+  std::array<char, 8> magic;
+  u32 version;
+  // endianness check, read back as IMAGE_VERSION only on a matching machine
+  u32 order;
+  std::array<char, 8> backend;
+  u32 value_size;
+  u32 instr_size;
+  // Bytecode<N>::Code::Return, which moves whenever instructions are added
+  u32 codes;
+  u32 formulas;
+  // index slots, a power of two at least twice the number of formulas
+  u32 slots;
+  u32 reserved = 0;
+  u64 size;
+  // hash_mix over the words after the header
+  u64 checksum;
+  u64 formulas_at, code_at, literals_at, by_name_at, by_hash_at, strings_at;
+  u64 code_count, literal_count, strings_size;
+};
+
+struct ImageFormula {
+  u64 name_hash;
+  // Expr::hash after the standard passes
+  u64 hash;
+  u32 code, code_count;
+  u32 literals;
+  u32 max_depth;
+  // in strings: the name, then var_count NUL-terminated variable names in slot order
+  u32 name, name_size;
+  u32 var_count;
+  u32 reserved = 0;
+};
+
+static_assert(std::is_trivially_copyable_v<ImageHeader> && std::is_trivially_copyable_v<ImageFormula>);
+
+// The backends whose values are plain bytes with no state in the backend
+template <typename N>
+constexpr string_view image_backend() {
+  if constexpr (std::is_same_v<N, F64Arith>) return "f64";
+  else if constexpr (std::is_same_v<N, I32Arith>) return "i32";
+  else if constexpr (std::is_same_v<N, I64Arith>) return "i64";
+  else if constexpr (std::is_same_v<N, I128Arith>) return "i128";
+  else return "";
+}
+
+inline u64 image_checksum(const u8* data, usize size) {
+  u64 h = 0;
+  for (usize i = 0; i + 8 <= size; i += 8) {
+    u64 w;
+    std::memcpy(&w, data + i, 8);
+    h = hash_mix(h, w);
+  }
+  return h;
+}
+
+// Inserts formula i into an open addressing index of slots entries
+inline void image_insert(u32* index, u32 slots, u64 hash, u32 i) {
+  for (u64 s = hash;; s++) {
+    if (index[s & (slots - 1)] == IMAGE_EMPTY) {
+      index[s & (slots - 1)] = i;
+      return;
+    }
+  }
+}
+
+// The image for the formulas in source, read from file (named in errors)
+template <typename N>
+string compile_image(const N& num, string_view source, string_view file) {
+  if constexpr (image_backend<N>().empty()) {
+    throw std::runtime_error("--compile supports the i32, i64, i128 and f64 backends");
+  } else {
+    using B = Bytecode<N>;
+    using Instr = typename B::Instr;
+    using Value = typename N::Value;
+
+    vector<ImageFormula> formulas;
+    vector<Instr> code;
+    vector<Value> literals;
+    string strings;
+    for_each_formula(source, file, [&](const string& name, string_view formula) {
+      Parser<N> p {.num = num, .tokens = Tokenizer(formula).tokenize(), .fold_constants = true};
+      auto expr = p.parse_expr();
+      PassManager<N>::standard().run(num, expr);
+      auto program = B::compile(*expr);
+
+      ImageFormula f {
+        .name_hash = hash_bytes(name),
+        .hash = expr->hash(num),
+        .code = (u32)code.size(),
+        .code_count = (u32)program.instructions().size(),
+        .literals = (u32)literals.size(),
+        .max_depth = (u32)program.stack_depth(),
+        .name = (u32)strings.size(),
+        .name_size = (u32)name.size(),
+        .var_count = (u32)p.variables.size(),
+      };
+      strings += name;
+      // slots the passes folded away have no name in the program, but keep their place
+      for (const auto& v: p.variables) strings += v + '\0';
+      code.insert(code.end(), program.instructions().begin(), program.instructions().end());
+      literals.insert(literals.end(), program.literals().begin(), program.literals().end());
+      formulas.push_back(f);
+      if (code.size() > IMAGE_EMPTY || literals.size() > IMAGE_EMPTY || strings.size() > IMAGE_EMPTY) {
+        throw std::runtime_error("Too many formulas for one image");
+      }
+    });
+
+    u32 slots = std::bit_ceil(std::max<u32>(2 * (u32)formulas.size(), 2));
+    auto align = [](u64 x) { return (x + 15) & ~u64(15); };
+    ImageHeader h {
+      .magic = IMAGE_MAGIC,
+      .version = IMAGE_VERSION,
+      .order = IMAGE_VERSION,
+      .backend = {},
+      .value_size = sizeof(Value),
+      .instr_size = sizeof(Instr),
+      .codes = (u32)B::Code::Return,
+      .formulas = (u32)formulas.size(),
+      .slots = slots,
+    };
+    std::copy_n(image_backend<N>().begin(), image_backend<N>().size(), h.backend.begin());
+    h.formulas_at = align(sizeof(ImageHeader));
+    h.code_at = align(h.formulas_at + formulas.size() * sizeof(ImageFormula));
+    h.literals_at = align(h.code_at + code.size() * sizeof(Instr));
+    h.by_name_at = align(h.literals_at + literals.size() * sizeof(Value));
+    h.by_hash_at = align(h.by_name_at + slots * sizeof(u32));
+    h.strings_at = align(h.by_hash_at + slots * sizeof(u32));
+    h.size = align(h.strings_at + strings.size());
+    h.code_count = code.size();
+    h.literal_count = literals.size();
+    h.strings_size = strings.size();
+
+    // Padding inside instructions and between sections is zero, so the
+    // same formulas always give the same bytes
+    string res(h.size, '\0');
+    u8* base = (u8*)res.data();
+    std::memcpy(base + h.formulas_at, formulas.data(), formulas.size() * sizeof(ImageFormula));
+    for (usize i = 0; i < code.size(); i++) {
+      auto* in = (Instr*)(base + h.code_at) + i;
+      in->code = code[i].code;
+      in->arg = code[i].arg;
+      in->arg2 = code[i].arg2;
+    }
+    std::memcpy(base + h.literals_at, literals.data(), literals.size() * sizeof(Value));
+    auto* by_name = (u32*)(base + h.by_name_at);
+    auto* by_hash = (u32*)(base + h.by_hash_at);
+    std::fill_n(by_name, slots, IMAGE_EMPTY);
+    std::fill_n(by_hash, slots, IMAGE_EMPTY);
+    for (u32 i = 0; i < formulas.size(); i++) {
+      image_insert(by_name, slots, formulas[i].name_hash, i);
+      image_insert(by_hash, slots, formulas[i].hash, i);
+    }
+    std::memcpy(base + h.strings_at, strings.data(), strings.size());
+    h.checksum = image_checksum(base + sizeof(ImageHeader), h.size - sizeof(ImageHeader));
+    std::memcpy(base, &h, sizeof h);
+    return res;
+  }
+}
+
+// A mapped image. Opening checks the header and that the sections fit in
+// the file, which takes constant time whatever the size of the image, and
+// each formula is checked when a lookup reaches it; verify() also checks the
+// checksum, every formula and the indexes.
+template <typename N>
+class Image {
+  using B = Bytecode<N>;
+  using Code = typename B::Code;
+  using Instr = typename B::Instr;
+  using Value = typename N::Value;
+
+public:
+  // A formula in the image, valid as long as the mapping is
+  class Formula {
+  public:
+    string_view name() const { return {strings(base) + f->name, f->name_size}; }
+
+    // Variable names in slot order
+    vector<string_view> variables() const {
+      vector<string_view> res;
+      const char* s = strings(base) + f->name + f->name_size;
+      for (u32 i = 0; i < f->var_count; i++) {
+        res.emplace_back(s);
+        s += res.back().size() + 1;
+      }
+      return res;
+    }
+
+    Value eval(const N& num, std::span<const Value> vars = {}) const {
+      return B::run(num, code(base) + f->code, literals(base) + f->literals, f->max_depth, vars,
+                    [&](u32 slot) { return string(variables()[slot]); });
+    }
+
+  private:
+    friend class Image;
+    Formula(const u8* base, const ImageFormula* f): base(base), f(f) {}
+
+    const u8* base;
+    const ImageFormula* f;
+  };
+
+  static Image open(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error(format("Cannot open {}: {}", path, std::strerror(errno)));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error(format("Cannot stat {}: {}", path, std::strerror(errno)));
+    }
+    Image res;
+    res.size = st.st_size;
+    if (res.size >= sizeof(ImageHeader)) {
+      void* p = mmap(nullptr, res.size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error(format("Cannot map {}: {}", path, std::strerror(errno)));
+      }
+      res.base = (const u8*)p;
+    }
+    close(fd);
+    if (auto err = res.check_header()) throw std::runtime_error(format("{} is not a usable image: {}", path, err));
+    return res;
+  }
+
+  Image(Image&& other) noexcept: base(std::exchange(other.base, nullptr)), size(other.size) {}
+  Image& operator=(Image other) noexcept {
+    std::swap(base, other.base);
+    std::swap(size, other.size);
+    return *this;
+  }
+  ~Image() {
+    if (base != nullptr) munmap((void*)base, size);
+  }
+
+  // Reads every page of the image
+  void verify() const {
+    const auto& h = header();
+    if (image_checksum(base + sizeof(ImageHeader), h.size - sizeof(ImageHeader)) != h.checksum) {
+      throw std::runtime_error("Image checksum mismatch");
+    }
+    for (u32 i = 0; i < h.formulas; i++) {
+      if (auto err = check_formula(formulas()[i])) throw std::runtime_error(format("Image formula {} has {}", i, err));
+    }
+    // each formula once in each index, reachable from its hash
+    for (u64 index_at: {h.by_name_at, h.by_hash_at}) {
+      const u32* index = (const u32*)(base + index_at);
+      vector<bool> seen(h.formulas);
+      for (u32 s = 0; s < h.slots; s++) {
+        if (index[s] == IMAGE_EMPTY) continue;
+        if (index[s] >= h.formulas || seen[index[s]]) throw std::runtime_error(format("Image index slot {} is invalid", s));
+        seen[index[s]] = true;
+      }
+      for (u32 i = 0; i < h.formulas; i++) {
+        const auto& f = formulas()[i];
+        u64 hash = index_at == h.by_name_at ? f.name_hash : f.hash;
+        if (!lookup(index_at, hash, [&](const ImageFormula& g) { return &g == &f; }).has_value()) {
+          throw std::runtime_error(format("Image formula {} is missing from its index", i));
+        }
+      }
+    }
+  }
+
+  usize formula_count() const { return header().formulas; }
+
+  optional<Formula> find(string_view name) const {
+    return lookup(header().by_name_at, hash_bytes(name), [&](const ImageFormula& f) {
+      return f.name_hash == hash_bytes(name) && Formula(base, &f).name() == name;
+    });
+  }
+
+  // A formula whose tree after the standard passes has this Expr::hash and
+  // compiles to program, with variables named as in variables by slot. The
+  // code confirms the match, as unrelated trees can share a hash.
+  optional<Formula> find(u64 hash, const B& program, std::span<const string> variables) const {
+    return lookup(header().by_hash_at, hash, [&](const ImageFormula& f) {
+      return f.hash == hash && same_code(f, program, variables);
+    });
+  }
+
+private:
+  const u8* base = nullptr;
+  usize size = 0;
+
+  Image() = default;
+
+  const ImageHeader& header() const { return header(base); }
+  const ImageFormula* formulas() const { return (const ImageFormula*)(base + header().formulas_at); }
+  const Instr* code() const { return code(base); }
+  const char* strings() const { return strings(base); }
+
+  static const ImageHeader& header(const u8* base) { return *(const ImageHeader*)base; }
+  static const Instr* code(const u8* base) { return (const Instr*)(base + header(base).code_at); }
+  static const Value* literals(const u8* base) { return (const Value*)(base + header(base).literals_at); }
+  static const char* strings(const u8* base) { return (const char*)(base + header(base).strings_at); }
+
+  // Probes at most every slot once, so that an index without an empty slot
+  // cannot loop forever. Each formula probed is checked before it is used.
+  template <typename Match>
+  optional<Formula> lookup(u64 index_at, u64 hash, Match&& match) const {
+    const auto& h = header();
+    const u32* index = (const u32*)(base + index_at);
+    for (u64 s = hash; s != hash + h.slots; s++) {
+      u32 i = index[s & (h.slots - 1)];
+      if (i == IMAGE_EMPTY) return {};
+      if (i >= h.formulas) continue;
+      if (auto err = check_formula(formulas()[i])) throw std::runtime_error(format("Image formula {} has {}", i, err));
+      if (match(formulas()[i])) return Formula(base, &formulas()[i]);
+    }
+    return {};
+  }
+
+  // Why f cannot be evaluated safely, or nullptr. Takes time in proportion
+  // to f's code and variables, not to the image.
+  const char* check_formula(const ImageFormula& f) const {
+    const auto& h = header();
+    if ((u64)f.code + f.code_count > h.code_count || f.code_count == 0) return "no valid code";
+    if (f.literals > h.literal_count) return "an invalid literal pool";
+    if ((u64)f.name + f.name_size > h.strings_size) return "an invalid name";
+    // a tree of height h needs a stack of h + 1 values, and the parser builds none taller
+    if (f.max_depth > Parser<N>::MAX_DEPTH + 1) return "too large a stack";
+    const char* end = strings() + h.strings_size;
+    const char* s = strings() + f.name + f.name_size;
+    for (u32 v = 0; v < f.var_count; v++) {
+      s = (const char*)std::memchr(s, '\0', end - s);
+      if (s++ == nullptr) return "invalid variable names";
+    }
+    // replay the stack heights, so that eval cannot read or write outside its stack
+    usize depth = 0, max_depth = 0;
+    for (u32 c = 0; c < f.code_count; c++) {
+      const auto& in = code()[f.code + c];
+      if ((u32)in.code > h.codes) return "an unknown instruction";
+      if (c + 1 == f.code_count) {
+        if (in.code != B::Code::Return || depth != 1) return "no final Return";
+        break;
+      }
+      auto effect = B::effect(in.code);
+      if (!effect.has_value()) return "a misplaced Return";
+      auto [pops, pushes, operands, count] = effect.value();
+      for (usize k = 0; k < count; k++) {
+        u32 arg = k == 0 ? in.arg : in.arg2;
+        if (operands[k] == B::Code::Literal && f.literals + (u64)arg >= h.literal_count) return "a literal out of range";
+        if (operands[k] == B::Code::Variable && arg >= f.var_count) return "a variable out of range";
+      }
+      if (depth < pops) return "a stack underflow";
+      depth = depth - pops + pushes;
+      max_depth = std::max(max_depth, depth);
+    }
+    if (max_depth > f.max_depth) return "too small a stack";
+    return nullptr;
+  }
+
+  // Whether f's code is program's, literals compared by value and variables
+  // by name
+  bool same_code(const ImageFormula& f, const B& program, std::span<const string> variables) const {
+    const auto& h = header();
+    const auto& other = program.instructions();
+    if (f.code_count != other.size() || (u64)f.code + f.code_count > h.code_count) return false;
+    auto names = Formula(base, &f).variables();
+    for (u32 c = 0; c < f.code_count; c++) {
+      const auto& in = code()[f.code + c];
+      if (in.code != other[c].code) return false;
+      auto effect = B::effect(in.code).value_or(typename B::Effect {});
+      for (usize k = 0; k < 2; k++) {
+        u32 arg = k == 0 ? in.arg : in.arg2, arg_other = k == 0 ? other[c].arg : other[c].arg2;
+        Code kind = k < effect.count ? effect.operands[k] : Code::Return;
+        if (kind == Code::Literal) {
+          if (f.literals + (u64)arg >= h.literal_count || arg_other >= program.literals().size()) return false;
+          const Value& x = literals(base)[f.literals + arg];
+          if (std::memcmp(&x, &program.literals()[arg_other], sizeof(Value)) != 0) return false;
+        } else if (kind == Code::Variable) {
+          if (arg >= names.size() || arg_other >= variables.size() || names[arg] != variables[arg_other]) return false;
+        } else if (arg != arg_other) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Why the header cannot be used, or nullptr
+  const char* check_header() const {
+    if (base == nullptr) return "too short";
+    const auto& h = header();
+    if (h.magic != IMAGE_MAGIC) return "bad magic";
+    if (h.order != IMAGE_VERSION && __builtin_bswap32(h.order) == IMAGE_VERSION) return "wrong byte order";
+    if (h.version != IMAGE_VERSION) return "unsupported version";
+    if (string_view(h.backend.data(), strnlen(h.backend.data(), h.backend.size())) != image_backend<N>()) {
+      return "compiled for another backend";
+    }
+    if (h.value_size != sizeof(Value) || h.instr_size != sizeof(Instr) || h.codes != (u32)B::Code::Return) {
+      return "compiled by an incompatible build";
+    }
+    if (h.size != size) return "truncated";
+    if (h.slots == 0 || !std::has_single_bit(h.slots) || h.slots <= h.formulas) return "bad index";
+    auto fits = [&](u64 at, u64 count, u64 elem, u64 align) {
+      return at % align == 0 && at <= size && count <= (size - at) / elem;
+    };
+    if (!fits(h.formulas_at, h.formulas, sizeof(ImageFormula), alignof(ImageFormula)) ||
+        !fits(h.code_at, h.code_count, sizeof(Instr), alignof(Instr)) ||
+        !fits(h.literals_at, h.literal_count, sizeof(Value), alignof(Value)) ||
+        !fits(h.by_name_at, h.slots, sizeof(u32), alignof(u32)) ||
+        !fits(h.by_hash_at, h.slots, sizeof(u32), alignof(u32)) || !fits(h.strings_at, h.strings_size, 1, 1)) {
+      return "sections out of bounds";
+    }
+    return nullptr;
+  }
+};
+//== end compiled images }}}
+
+//== C API ===== {{{
+// The functions declared in pratt.h, built into libpratt with PRATT_LIBRARY
+// defined, which also leaves out main. A pratt_expr is a TieredExpr: it
+// starts on the tree walk, so compiling one that is evaluated once costs no
+// more than parsing it, and the Tiering of the context that compiled it
+// promotes it in the background once it is called often. No exception
+// reaches the caller: each entry point turns one into a status and the
+// context's error.
+#ifdef PRATT_LIBRARY
+
+// The backends whose values fit in a pratt_value
+using CBackend = std::variant<I32Arith, I64Arith, F64Arith>;
+
+template <typename N>
+struct CProgram {
+  // first, so that it goes after the expression; it outlives its context
+  // while expressions it tiers remain
+  shared_ptr<Tiering<N>> tiering;
+  shared_ptr<TieredExpr<N>> expr;
+  // names by slot, including those the passes folded away
+  vector<string> variables;
+};
+
+struct pratt_expr {
+  std::variant<CProgram<I32Arith>, CProgram<I64Arith>, CProgram<F64Arith>> program;
+};
+
+struct pratt_ctx {
+  CBackend backend;
+  string error;
+  std::unordered_map<string, pratt_value> bindings;
+  // one row of converted variables, reused across calls
+  std::tuple<vector<i32>, vector<i64>, vector<f64>> scratch;
+  // started by the first pratt_compile
+  std::tuple<shared_ptr<Tiering<I32Arith>>, shared_ptr<Tiering<I64Arith>>, shared_ptr<Tiering<F64Arith>>> tierings;
+
+  template <typename N>
+  vector<typename N::Value>& row() { return std::get<vector<typename N::Value>>(scratch); }
+
+  template <typename N>
+  const shared_ptr<Tiering<N>>& tiering(const N& num) {
+    auto& t = std::get<shared_ptr<Tiering<N>>>(tierings);
+    if (t == nullptr) t = make_shared<Tiering<N>>(num);
+    return t;
+  }
+};
+
+template <typename N>
+typename N::Value from_c(pratt_value v) {
+  if constexpr (std::is_same_v<N, F64Arith>) {
+    return v.f;
+  } else {
+    using T = typename N::Value;
+    if (v.i < std::numeric_limits<T>::min() || v.i > std::numeric_limits<T>::max()) {
+      throw std::runtime_error(format("{} does not fit in {}", v.i, N::name()));
+    }
+    return (T)v.i;
+  }
+}
+
+template <typename N>
+pratt_value to_c(typename N::Value x) {
+  pratt_value res;
+  if constexpr (std::is_same_v<N, F64Arith>) res.f = x;
+  else res.i = x;
+  return res;
+}
+
+// Runs f, returning 0, or the error it throws as 1. The error is cleared
+// first, so that pratt_error only describes the latest call.
+template <typename F>
+int c_guard(pratt_ctx* ctx, F&& f) {
+  ctx->error.clear();
+  try {
+    f();
+    return 0;
+  } catch (const std::exception& e) {
+    try {
+      ctx->error = e.what();
+    } catch (...) {
+      // short enough not to allocate
+      ctx->error = "Out of memory";
+    }
+  } catch (...) {
+    ctx->error = "Unknown error";
+  }
+  return 1;
+}
+
+// Calls f(num, program) with the context's backend and expr's program, which must agree
+template <typename F>
+void c_visit(pratt_ctx* ctx, const pratt_expr* expr, F&& f) {
+  if (expr->program.index() != ctx->backend.index()) throw std::runtime_error("Expression was compiled for another backend");
+  std::visit([&](const auto& num) {
+    using N = std::decay_t<decltype(num)>;
+    f(num, std::get<CProgram<N>>(expr->program));
+  }, ctx->backend);
+}
+
+pratt_ctx* pratt_ctx_new(const char* backend) {
+  string_view name = backend != nullptr ? backend : "";
+  optional<CBackend> num;
+  if (name == "i32") num = I32Arith{};
+  else if (name == "i64") num = I64Arith{};
+  else if (name == "f64") num = F64Arith{};
+  else return nullptr;
+  try {
+    return new pratt_ctx {.backend = num.value()};
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void pratt_ctx_free(pratt_ctx* ctx) { delete ctx; }
+
+const char* pratt_error(const pratt_ctx* ctx) { return ctx->error.c_str(); }
+
+int pratt_bind(pratt_ctx* ctx, const char* name, pratt_value value) {
+  return c_guard(ctx, [&] {
+    if (name == nullptr) throw std::runtime_error("Variable name is NULL");
+    ctx->bindings.insert_or_assign(name, value);
+  });
+}
+
+pratt_expr* pratt_compile(pratt_ctx* ctx, const char* src, size_t len) {
+  pratt_expr* res = nullptr;
+  c_guard(ctx, [&] {
+    if (src == nullptr && len != 0) throw std::runtime_error("Source is NULL");
+    std::visit([&](const auto& num) {
+      using N = std::decay_t<decltype(num)>;
+      Parser<N> p {.num = num, .tokens = Tokenizer(string_view(src, len)).tokenize(), .fold_constants = true};
+      auto expr = p.parse_expr();
+      PassManager<N>::standard().run(num, expr);
+      auto& tiering = ctx->tiering(num);
+      res = new pratt_expr {CProgram<N> {tiering, tiering->add(std::move(expr)), std::move(p.variables)}};
+    }, ctx->backend);
+  });
+  return res;
+}
+
+void pratt_expr_free(pratt_expr* expr) { delete expr; }
+
+size_t pratt_expr_variable_count(const pratt_expr* expr) {
+  return std::visit([](const auto& program) { return program.variables.size(); }, expr->program);
+}
+
+const char* pratt_expr_variable(const pratt_expr* expr, size_t slot) {
+  return std::visit([&](const auto& program) -> const char* {
+    return slot < program.variables.size() ? program.variables[slot].c_str() : nullptr;
+  }, expr->program);
+}
+
+int pratt_eval(pratt_ctx* ctx, const pratt_expr* expr, const pratt_value* vars, size_t var_count, pratt_value* out) {
+  return pratt_eval_rows(ctx, expr, vars, var_count, 1, out, nullptr) == 0 ? 0 : 1;
+}
+
+size_t pratt_eval_strings(pratt_ctx* ctx, const char* const* srcs, const size_t* lens, size_t count, pratt_value* out,
+                          int* status) {
+  size_t failed = 0;
+  // the row guards clear the error, so the first one is kept here
+  string first;
+  c_guard(ctx, [&] {
+    std::visit([&](const auto& num) {
+      using N = std::decay_t<decltype(num)>;
+      auto& vars = ctx->row<N>();
+      for (size_t r = 0; r < count; r++) {
+        // evaluated once, so the tree walk beats compiling
+        int s = c_guard(ctx, [&] {
+          if (srcs[r] == nullptr) throw std::runtime_error(format("Source {} is NULL", r));
+          string_view src = lens != nullptr ? string_view(srcs[r], lens[r]) : string_view(srcs[r]);
+          Parser<N> p {.num = num, .tokens = Tokenizer(src).tokenize(), .fold_constants = true};
+          auto expr = p.parse_expr();
+          vars.clear();
+          for (const auto& name: p.variables) {
+            auto it = ctx->bindings.find(name);
+            if (it == ctx->bindings.end()) throw std::runtime_error(format("No value given for variable '{}'", name));
+            vars.push_back(from_c<N>(it->second));
+          }
+          out[r] = to_c<N>(expr->eval(num, vars));
+        });
+        if (status != nullptr) status[r] = s;
+        if (s != 0 && failed++ == 0) first = std::move(ctx->error);
+      }
+    }, ctx->backend);
+    ctx->error = std::move(first);
+  });
+  return failed;
+}
+
+size_t pratt_eval_rows(pratt_ctx* ctx, const pratt_expr* expr, const pratt_value* vars, size_t var_count, size_t count,
+                       pratt_value* out, int* status) {
+  size_t failed = 0;
+  // the row guards clear the error, so the first one is kept here
+  string first;
+  int s = c_guard(ctx, [&] {
+    c_visit(ctx, expr, [&](const auto& num, const auto& program) {
+      using N = std::decay_t<decltype(num)>;
+      auto& row = ctx->row<N>();
+      for (size_t r = 0; r < count; r++) {
+        int rs = c_guard(ctx, [&] {
+          row.clear();
+          for (size_t v = 0; v < var_count; v++) row.push_back(from_c<N>(vars[r * var_count + v]));
+          out[r] = to_c<N>(program.expr->eval(row));
+        });
+        if (status != nullptr) status[r] = rs;
+        if (rs != 0 && failed++ == 0) first = std::move(ctx->error);
+      }
+    });
+    ctx->error = std::move(first);
+  });
+  // a backend mismatch fails every row
+  if (s != 0) {
+    if (status != nullptr) std::fill_n(status, count, 1);
+    return count;
+  }
+  return failed;
+}
+
+#endif
+//== end C API }}}
+
+
+// The command line tool, left out of libpratt
+#ifndef PRATT_LIBRARY
+struct Options {
+  bool print_tokens = true;
+  bool print_ast = true;
+  bool fold_constants = false;
+  // Run the standard rewrite passes before evaluating
+  bool optimize = false;
+  // Evaluate a file or stdin with eval_stream instead of parsing an argument
+  bool stream = false;
+  // Only validate syntax, see check_syntax
+  bool check = false;
+  // Evaluate each line of a file or stdin on its own, see run_batch
+  bool batch = false;
+  // Count instruction pairs and triples over the lines of a file or stdin, see run_profile
+  bool profile = false;
+  // Time this many rounds of evaluating the lines of a file or stdin with each engine
+  usize bench = 0;
+  // Tokenize, parse and evaluate with tokenize_parallel, ParallelParser and
+  // ParallelEvaluator on this many threads, 0 for one per core
+  usize threads = 1;
+  // Read the expression, or the input of --stream, --batch, --profile,
+  // --bench and --check, from this file instead of the argument or stdin
+  optional<string> input;
+  // Generate a C++ header from this file of named formulas, see emit_cpp
+  optional<string> emit_cpp;
+  // Write generated output here instead of stdout
+  optional<string> output;
+  // Namespace for the functions generated by --emit-cpp
+  string cpp_namespace;
+  // Compile this file of named formulas into an Image, see compile_image
+  optional<string> compile;
+  // Evaluate a formula of this Image, named by the argument or matching it
+  optional<string> load;
+  // Check the loaded image's checksum and code before using it
+  bool verify = false;
+  // Serve requests on this Unix domain socket, see serve
+  optional<string> serve;
+  // Collect requests this long before handing them to a worker as a batch
+  usize window_us = 50;
+  // Send the argument to the server on this socket and measure latency, see load_test
+  optional<string> loadgen;
+  f64 qps = 10'000;
+  f64 duration = 5;
+  usize connections = 1;
+  // Budget of each --loadgen request in microseconds, 0 for none
+  u32 deadline_us = 0;
+  // --loadgen requests due at the same time
+  usize burst = 1;
+  // Serve requests through this shared memory ring, see serve_shm
+  optional<string> serve_shm;
+  u32 slots = 256;
+  // How a parsed tree is evaluated: "tree" walks the Expr, "closure" and "vm"
+  // compile it into a Closure or Bytecode first. --threads always uses
+  // ParallelEvaluator.
+  string engine = "tree";
+  string backend = "i64";
+  optional<u64> modulus;
+  // name=expr pairs from --let
+  vector<pair<string, string>> bindings;
+};
+
+// Calls f with the numeric backend selected on the command line. Each
+// backend gets its own instantiation of the parser and evaluator.
+template <typename F>
+void with_backend(const Options& opts, F&& f) {
+  if (opts.modulus.has_value()) f(ModArith(opts.modulus.value()));
+  else if (opts.backend == "i32") f(I32Arith{});
+  else if (opts.backend == "i64") f(I64Arith{});
+  else if (opts.backend == "i128") f(I128Arith{});
+  else if (opts.backend == "f64") f(F64Arith{});
+  else if (opts.backend == "big") f(BigArith{});
+  else if (opts.backend == "rational") f(RationalArith{});
+  else throw std::runtime_error(format("Unknown backend \"{}\"", opts.backend));
+}
+
+// Evaluates the right hand side of a --let binding, which may not refer to variables
+template <typename N>
+typename N::Value eval_binding(const N& num, string_view source) {
+  Tokenizer tokenizer(source);
+  Parser<N> p {.num = num, .tokens = tokenizer.tokenize()};
+  return p.parse_expr()->eval(num);
+}
+
+// Values for the parser's variables, in slot order, from the --let bindings
+template <typename N>
+vector<typename N::Value> bind_variables(const N& num, const vector<string>& variables, const Options& opts) {
+  vector<typename N::Value> vars;
+  for (const auto& name: variables) {
+    auto it = std::find_if(opts.bindings.begin(), opts.bindings.end(), [&](const auto& b) { return b.first == name; });
+    if (it == opts.bindings.end()) throw std::runtime_error(format("No value given for variable '{}'", name));
+    vars.push_back(eval_binding(num, it->second));
+  }
+  return vars;
+}
+
+template <typename N>
+void run(const N& num, const vector<Token>& tokens, const Options& opts, WorkStealingPool* pool) {
+  Parser<N> p {.num = num, .tokens = tokens, .fold_constants = opts.fold_constants};
+  auto expr = pool != nullptr ? ParallelParser<N>(p, *pool).parse() : p.parse_expr();
+
+  if (opts.optimize) {
+    auto stats = PassManager<N>::standard().run(num, expr);
+    cout << "#== Passes ==\n";
+    for (const auto& s: stats) cout << s.str() << "\n";
+    cout << "\n";
+  }
+
+  if (opts.print_ast) {
+    cout << "#== AST =====\n";
+    std::cout << expr->str(num) << "\n";
+    std::cout << format("hash {:016x}", expr->hash(num)) << "\n\n";
+  }
+
+  auto vars = bind_variables(num, p.variables, opts);
+  typename N::Value result;
+  if (pool != nullptr) result = ParallelEvaluator<N>(num, vars, *pool).eval(*expr);
+  else if (opts.engine == "closure") result = Closure<N>::compile(*expr).eval(num, vars);
+  else if (opts.engine == "vm") result = Bytecode<N>::compile(*expr).eval(num, vars);
+  else result = expr->eval(num, vars);
+
+  std::cout << num.str(result) << std::endl;
+}
+
+// Prints the value of each line of fd, or the error evaluating it
+template <typename N>
+void run_batch(const N& num, int fd, const Options& opts) {
+  std::unordered_map<string, typename N::Value> bindings;
+  for (const auto& [name, source]: opts.bindings) bindings.insert_or_assign(name, eval_binding(num, source));
+
+  SpscQueue<unique_ptr<Batch<N>>> tokenized(8), parsed(8);
+  std::exception_ptr failed;
+  std::thread reader([&] {
+    try {
+      read_batches(fd, tokenized);
+    } catch (...) {
+      failed = std::current_exception();
+    }
+    tokenized.close();
+  });
+  std::thread parser([&] {
+    parse_batches(num, opts.fold_constants, tokenized, parsed);
+    parsed.close();
+  });
+
+  string out;
+  vector<typename N::Value> vars;
+  while (auto batch = parsed.pop()) {
+    auto& b = *batch.value();
+    for (usize r = 0; r < b.rows.size(); r++) {
+      if (b.errors[r].empty()) {
+        try {
+          vars.clear();
+          for (const auto& name: b.variables[r]) {
+            auto it = bindings.find(name);
+            if (it == bindings.end()) throw std::runtime_error(format("No value given for variable '{}'", name));
+            vars.push_back(it->second);
+          }
+          if (opts.engine == "closure") out += num.str(Closure<N>::compile(*b.exprs[r]).eval(num, vars));
+          else if (opts.engine == "vm") out += num.str(Bytecode<N>::compile(*b.exprs[r]).eval(num, vars));
+          else out += num.str(b.exprs[r]->eval(num, vars));
+        } catch (const std::runtime_error& e) {
+          b.errors[r] = e.what();
+        }
+      }
+      if (!b.errors[r].empty()) out += "error: " + b.errors[r];
+      out += '\n';
+    }
+    std::cout << out;
+    out.clear();
+  }
+  reader.join();
+  parser.join();
+  std::cout.flush();
+  if (failed) std::rethrow_exception(failed);
+}
+
+template <typename N>
+void run_stream(const N& num, int fd, const Options& opts) {
+  std::unordered_map<string, typename N::Value> bindings;
+  for (const auto& [name, source]: opts.bindings) bindings.insert_or_assign(name, eval_binding(num, source));
+  std::cout << num.str(eval_stream(num, fd, bindings)) << std::endl;
+}
+
+// The lines of fd that parse and whose variables are all bound by --let,
+// for --profile and --bench
+template <typename N>
+struct Corpus {
+  vector<unique_ptr<Expr<N>>> exprs;
+  vector<vector<typename N::Value>> vars;
+  usize skipped = 0;
+};
+
+template <typename N>
+Corpus<N> read_corpus(const N& num, int fd, const Options& opts) {
+  string text;
+  char buf[1 << 16];
+  isize n;
+  while ((n = read(fd, buf, sizeof buf)) > 0) text.append(buf, n);
+  if (n < 0) throw std::runtime_error(format("Cannot read input: {}", std::strerror(errno)));
+
+  std::unordered_map<string, typename N::Value> bindings;
+  for (const auto& [name, source]: opts.bindings) bindings.insert_or_assign(name, eval_binding(num, source));
+  Corpus<N> corpus;
+  for (usize start = 0; start < text.size();) {
+    usize end = std::min(text.find('\n', start), text.size());
+    string_view line = string_view(text).substr(start, end - start);
+    start = end + 1;
+    try {
+      Parser<N> p {.num = num, .tokens = Tokenizer(line).tokenize(), .fold_constants = opts.fold_constants};
+      auto expr = p.parse_expr();
+      vector<typename N::Value> vars;
+      for (const auto& name: p.variables) {
+        auto it = bindings.find(name);
+        if (it == bindings.end()) throw std::runtime_error(format("No value given for variable '{}'", name));
+        vars.push_back(it->second);
+      }
+      corpus.exprs.push_back(std::move(expr));
+      corpus.vars.push_back(std::move(vars));
+    } catch (const std::runtime_error&) {
+      corpus.skipped++;
+    }
+  }
+  return corpus;
+}
+
+// Prints how often each pair and triple of instructions occurs in the
+// unfused bytecode of fd's lines, and the most frequent ones that can be
+// fused as FUSED_PAIRS and FUSED_TRIPLES
+template <typename N>
+void run_profile(const N& num, int fd, const Options& opts) {
+  static constexpr usize SHOWN = 20, FUSED = 8;
+  using B = Bytecode<N>;
+  using Code = typename B::Code;
+
+  auto corpus = read_corpus(num, fd, opts);
+  std::unordered_map<u32, usize> pairs, triples;
+  for (const auto& e: corpus.exprs) {
+    auto code = B::compile(*e, false).instructions();
+    code.pop_back(); // Return
+    for (usize i = 0; i + 1 < code.size(); i++) pairs[(u32)code[i].code << 8 | (u32)code[i + 1].code]++;
+    for (usize i = 0; i + 2 < code.size(); i++) {
+      triples[(u32)code[i].code << 16 | (u32)code[i + 1].code << 8 | (u32)code[i + 2].code]++;
+    }
+  }
+  auto sorted = [](const auto& counts) {
+    vector<pair<u32, usize>> res(counts.begin(), counts.end());
+    std::sort(res.begin(), res.end(), [](const auto& a, const auto& b) { return a.second != b.second ? a.second > b.second : a.first < b.first; });
+    return res;
+  };
+  auto code = [](u32 key, u32 i) { return (Code)(key >> (8 * i) & 0xff); };
+  auto op_name = [](Code c) { return B::binary_op(c).value().name(); };
+
+  cout << format("#== Profile of {} expressions, {} skipped ==\n", corpus.exprs.size(), corpus.skipped);
+  cout << "\n#== Pairs ==\n";
+  auto by_pair = sorted(pairs);
+  for (usize i = 0; i < std::min(SHOWN, by_pair.size()); i++) {
+    auto [key, count] = by_pair[i];
+    cout << format("{:>12} {} {}\n", count, B::name(code(key, 1)), B::name(code(key, 0)));
+  }
+  cout << "\n#== Triples ==\n";
+  auto by_triple = sorted(triples);
+  for (usize i = 0; i < std::min(SHOWN, by_triple.size()); i++) {
+    auto [key, count] = by_triple[i];
+    cout << format("{:>12} {} {} {}\n", count, B::name(code(key, 2)), B::name(code(key, 1)), B::name(code(key, 0)));
+  }
+
+  cout << "\n#== Table ==\n#define FUSED_PAIRS \\\n";
+  usize fused = 0;
+  for (auto [key, count]: by_pair) {
+    if (fused == FUSED) break;
+    if (!B::is_operand(code(key, 1)) || !B::binary_op(code(key, 0))) continue;
+    cout << format("  X({}, {}) \\\n", B::name(code(key, 1)), op_name(code(key, 0)));
+    fused++;
+  }
+  cout << "\n#define FUSED_TRIPLES \\\n";
+  fused = 0;
+  for (auto [key, count]: by_triple) {
+    if (fused == FUSED) break;
+    if (!B::is_operand(code(key, 2)) || !B::is_operand(code(key, 1)) || !B::binary_op(code(key, 0))) continue;
+    cout << format("  X({}, {}, {}) \\\n", B::name(code(key, 2)), op_name(code(key, 0)), B::name(code(key, 1)));
+    fused++;
+  }
+  cout << std::endl;
+}
+
+// Times opts.bench evaluations of every line of fd with each engine,
+// compiling first where the engine needs it
+template <typename N>
+void run_bench(const N& num, int fd, const Options& opts) {
+  auto corpus = read_corpus(num, fd, opts);
+  auto time = [&](string_view engine, auto&& eval) {
+    usize errors = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (usize round = 0; round < opts.bench; round++) {
+      for (usize r = 0; r < corpus.exprs.size(); r++) {
+        try {
+          eval(r);
+        } catch (const std::runtime_error&) {
+          errors++;
+        }
+      }
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    usize evals = std::max<usize>(opts.bench * corpus.exprs.size(), 1);
+    cout << format("{:<12} {:>10.1f} ms {:>10.1f} ns/expr {:>8} errors\n", engine, secs.count() * 1e3, secs.count() * 1e9 / evals, errors);
+  };
+
+  cout << format("#== {} expressions, {} skipped, {} rounds ==\n", corpus.exprs.size(), corpus.skipped, opts.bench);
+  time("tree", [&](usize r) { return corpus.exprs[r]->eval(num, corpus.vars[r]); });
+  vector<Closure<N>> closures;
+  for (const auto& e: corpus.exprs) closures.push_back(Closure<N>::compile(*e));
+  time("closure", [&](usize r) { return closures[r].eval(num, corpus.vars[r]); });
+  for (bool fuse: {false, true}) {
+    vector<Bytecode<N>> programs;
+    for (const auto& e: corpus.exprs) programs.push_back(Bytecode<N>::compile(*e, fuse));
+    time(fuse ? "vm" : "vm-unfused", [&](usize r) { return programs[r].eval(num, corpus.vars[r]); });
+  }
+
+  // tiered takes ownership of the trees, so it goes last
+  Tiering<N> tiering(num);
+  vector<shared_ptr<TieredExpr<N>>> tiered;
+  for (auto& e: corpus.exprs) tiered.push_back(tiering.add(std::move(e)));
+  time("tiered", [&](usize r) { return tiered[r]->eval(corpus.vars[r]); });
+  tiering.wait();
+  cout << "\n#== Tiering ==\n" << tiering.metrics().str() << "\n";
+}
+
+//== Evaluation server ===== {{{
+// pratt --serve PATH answers requests from other processes on the same host
+// over a Unix domain socket. One thread runs an epoll loop that accepts
+// connections, reads requests and writes responses; worker threads evaluate.
+// Requests that arrive within a short window of each other, on any
+// connection, are handed to a worker as one batch, so a burst of tiny
+// requests costs one queue handoff and one wakeup instead of one each.
+//
+// Every message is a frame: a u32 size followed by that many bytes. Integers
+// are in host byte order, since both ends are on the same machine.
+//   request:  u32 id, u16 binding count, u16 kind, u32 budget, bindings, source
+//             binding: u16 name size, u16 value size, name, value
+//   response: u32 id, u8 status, result or message
+// A binding's value is an expression without variables, as with --let, and
+// overrides the server's own --let for that request.
+//
+// A request with a budget must be answered within that many microseconds of
+// arriving. Workers take requests earliest deadline first, and a request is
+// shed on arrival if the estimated time to answer it would exceed its budget:
+// the rest of the batch window, the estimated cost of the requests with a
+// deadline queued ahead of it, and its own. Costs are measured per bucket of
+// request sizes, compiles included, and a request with nothing queued ahead
+// is always admitted, so that one slow request does not shed the rest for
+// good.
+// A request whose deadline passes while it is queued is dropped instead of
+// evaluated, since nobody is waiting for its answer any more.
+//
+// A connection's requests stop being read while too many of its answers are
+// waiting to be written or evaluated, and a client that shuts down its end
+// still gets the answers to everything it sent before.
+
+struct StringHash {
+  using is_transparent = void;
+  usize operator()(string_view s) const { return std::hash<string_view>{}(s); }
+};
+
+constexpr usize SERVE_MAX_FRAME = 1 << 20;
+constexpr usize SERVE_MAX_BATCH = 64;
+// compiled programs kept per worker before its cache is cleared
+constexpr usize SERVE_CACHE_SIZE = 4096;
+constexpr usize SERVE_HEADER_SIZE = 12;
+// per connection, the bytes of answers waiting to be written and the
+// requests waiting to be answered above which its requests are not read
+constexpr usize SERVE_MAX_OUT = 1 << 20;
+constexpr usize SERVE_MAX_IN_FLIGHT = 4096;
+// request sizes up to SERVE_MAX_FRAME, by bit width
+constexpr usize SERVE_COST_BUCKETS = std::bit_width(SERVE_MAX_FRAME) + 1;
+
+enum class ServeKind : u16 {
+  Eval,
+  // answered with ServeStats::str
+  Stats,
+};
+
+enum class ServeStatus : u8 {
+  Ok,
+  Error,
+  // rejected on arrival, it would have missed its deadline
+  Shed,
+  // its deadline passed before a worker got to it
+  Expired,
+};
+
+template <typename T>
+void put(string& out, T x) {
+  out.append((const char*)&x, sizeof x);
+}
+
+template <typename T>
+T get(string_view in, usize at) {
+  T x;
+  std::memcpy(&x, in.data() + at, sizeof x);
+  return x;
+}
+
+// The frame for a request
+inline string serve_request(u32 id, const vector<pair<string, string>>& bindings, string_view source,
+                            u32 budget_us = 0, ServeKind kind = ServeKind::Eval) {
+  string res;
+  put<u32>(res, 0);
+  put<u32>(res, id);
+  put<u16>(res, bindings.size());
+  put<u16>(res, (u16)kind);
+  put<u32>(res, budget_us);
+  for (const auto& [name, value]: bindings) {
+    put<u16>(res, name.size());
+    put<u16>(res, value.size());
+    res += name;
+    res += value;
+  }
+  res += source;
+  u32 size = res.size() - sizeof(u32);
+  std::memcpy(res.data(), &size, sizeof size);
+  return res;
+}
+
+// Appends a response frame to out
+inline void serve_response(string& out, u32 id, ServeStatus status, string_view text) {
+  put<u32>(out, sizeof(u32) + sizeof(u8) + text.size());
+  put<u32>(out, id);
+  put<u8>(out, (u8)status);
+  out += text;
+}
+
+// Removes the complete frames at the front of buf and calls f with each
+// payload. Returns false if a frame is too large to accept.
+template <typename F>
+bool take_frames(string& buf, F&& f) {
+  usize at = 0;
+  while (buf.size() - at >= sizeof(u32)) {
+    u32 size = get<u32>(buf, at);
+    if (size > SERVE_MAX_FRAME) return false;
+    if (buf.size() - at - sizeof(u32) < size) break;
+    f(string_view(buf).substr(at + sizeof(u32), size));
+    at += sizeof(u32) + size;
+  }
+  buf.erase(0, at);
+  return true;
+}
+
+using ServeClock = std::chrono::steady_clock;
+
+// A request on its way to a worker. conn tells connections apart after
+// their file descriptor has been reused.
+struct ServeRequest {
+  int fd;
+  u64 conn;
+  string payload;
+  // time_point::max() without a budget
+  ServeClock::time_point deadline;
+  // estimated when it was admitted
+  f64 cost_us;
+  // arrival order, so that requests with the same deadline keep it
+  u64 seq;
+};
+
+struct ServeResponse {
+  int fd;
+  u64 conn;
+  string frame;
+};
+
+struct ServeStats {
+  std::atomic<u64> answered = 0, errors = 0, shed = 0, expired = 0;
+  // evaluated, but answered after the deadline
+  std::atomic<u64> late = 0;
+
+  string str() const {
+    return format("answered {} errors {} shed {} expired {} late {}", answered.load(), errors.load(), shed.load(),
+                  expired.load(), late.load());
+  }
+};
+
+// Requests waiting for a worker, earliest deadline first. Workers sleep
+// while it is empty.
+class DeadlineQueue {
+public:
+  // Moves every request of batch in, under one lock
+  void push(vector<ServeRequest>& batch) {
+    {
+      std::lock_guard guard(lock);
+      for (auto& r: batch) {
+        count_deadline(r, 1);
+        heap.push_back(std::move(r));
+        std::push_heap(heap.begin(), heap.end(), later);
+      }
+      queued.store(heap.size(), std::memory_order_relaxed);
+    }
+    if (batch.size() == 1) ready.notify_one();
+    else ready.notify_all();
+    batch.clear();
+  }
+
+  // Moves up to max of the earliest requests into out. False once the queue
+  // is closed and empty.
+  bool pop(vector<ServeRequest>& out, usize max) {
+    std::unique_lock guard(lock);
+    ready.wait(guard, [&] { return !heap.empty() || closed; });
+    if (heap.empty()) return false;
+    for (usize i = 0; i < max && !heap.empty(); i++) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      count_deadline(heap.back(), -1);
+      out.push_back(std::move(heap.back()));
+      heap.pop_back();
+    }
+    queued.store(heap.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard guard(lock);
+      closed = true;
+    }
+    ready.notify_all();
+  }
+
+  usize size() const { return queued.load(std::memory_order_relaxed); }
+
+  // The estimated cost of the queued requests with a budget. Those without
+  // one are served after them, so they do not delay a new request with a
+  // deadline.
+  f64 deadline_cost() const { return cost.load(std::memory_order_relaxed); }
+
+private:
+  // Adds or removes r's cost, under the lock
+  void count_deadline(const ServeRequest& r, int sign) {
+    if (r.deadline == ServeClock::time_point::max()) return;
+    deadlines += sign;
+    // without rounding left behind once there are none
+    cost_sum = deadlines == 0 ? 0 : cost_sum + sign * r.cost_us;
+    cost.store(cost_sum, std::memory_order_relaxed);
+  }
+
+  static bool later(const ServeRequest& a, const ServeRequest& b) {
+    return a.deadline != b.deadline ? a.deadline > b.deadline : a.seq > b.seq;
+  }
+
+  std::mutex lock;
+  std::condition_variable ready;
+  vector<ServeRequest> heap;
+  bool closed = false;
+  usize deadlines = 0;
+  f64 cost_sum = 0;
+  std::atomic<usize> queued = 0;
+  std::atomic<f64> cost = 0;
+};
+
+// Evaluates requests on one worker thread. Programs are parsed once per
+// source and cached as TieredExprs of the server's Tiering, so a source
+// seen once is only walked, and one seen often is compiled in the
+// background. The buffers for variables and responses are reused from one
+// batch to the next, so a warm worker does not allocate for a cached
+// request.
+template <typename N>
+class ServeWorker {
+  using Value = typename N::Value;
+
+public:
+  ServeWorker(const N& num, Tiering<N>& tiering, const std::unordered_map<string, Value>& defaults)
+      : num(num), tiering(tiering), defaults(defaults) {}
+
+  // Appends the response frame for payload to out and returns its status
+  ServeStatus answer(string_view payload, string& out) {
+    usize start = out.size();
+    put<u32>(out, 0);
+    put<u32>(out, payload.size() >= 4 ? get<u32>(payload, 0) : 0);
+    put<u8>(out, 0);
+    if (read_bindings(payload)) {
+      out[start + 8] = respond(payload.substr(SERVE_HEADER_SIZE + binding_bytes), out);
+      bindings.clear();
+    } else {
+      out[start + 8] = 1;
+      out += "Malformed request";
+    }
+    u32 size = out.size() - start - sizeof(u32);
+    std::memcpy(out.data() + start, &size, sizeof size);
+    return (ServeStatus)out[start + 8];
+  }
+
+  // Appends the value of source, or the error evaluating it, to out and
+  // returns 0 or 1. source is only copied the first time it is seen. Outside
+  // answer there are no per-request bindings.
+  u8 respond(string_view source, string& out) {
+    usize start = out.size();
+    try {
+      out += num.str(eval(source));
+      return 0;
+    } catch (const std::exception& e) {
+      // any error, out of memory included, fails the request and not the server
+      out.resize(start);
+      out += e.what();
+      return 1;
+    } catch (...) {
+      out.resize(start);
+      out += "Unknown error";
+      return 1;
+    }
+  }
+
+private:
+  struct Program {
+    shared_ptr<TieredExpr<N>> expr;
+    vector<string> variables;
+  };
+
+  const N& num;
+  Tiering<N>& tiering;
+  const std::unordered_map<string, Value>& defaults;
+  std::unordered_map<string, Program, StringHash, std::equal_to<>> cache;
+  vector<Value> vars;
+  // of the request being answered, and the bytes they take up
+  vector<pair<string_view, string_view>> bindings;
+  usize binding_bytes = 0;
+
+  bool read_bindings(string_view payload) {
+    bindings.clear();
+    binding_bytes = 0;
+    if (payload.size() < SERVE_HEADER_SIZE) return false;
+    usize count = get<u16>(payload, 4), at = SERVE_HEADER_SIZE;
+    for (usize i = 0; i < count; i++) {
+      if (payload.size() - at < 4) return false;
+      usize name = get<u16>(payload, at), value = get<u16>(payload, at + 2);
+      at += 4;
+      if (payload.size() - at < name + value) return false;
+      bindings.emplace_back(payload.substr(at, name), payload.substr(at + name, value));
+      at += name + value;
+    }
+    binding_bytes = at - SERVE_HEADER_SIZE;
+    return true;
+  }
+
+  Value eval(string_view source) {
+    auto it = cache.find(source);
+    if (it == cache.end()) {
+      if (cache.size() >= SERVE_CACHE_SIZE) cache.clear();
+      Parser<N> p {.num = num, .tokens = Tokenizer(source).tokenize(), .fold_constants = true};
+      auto expr = p.parse_expr();
+      it = cache.emplace(string(source), Program {tiering.add(std::move(expr)), std::move(p.variables)}).first;
+    }
+
+    vars.clear();
+    for (const auto& name: it->second.variables) {
+      auto b = std::find_if(bindings.begin(), bindings.end(), [&](const auto& b) { return b.first == name; });
+      if (b != bindings.end()) {
+        vars.push_back(eval_binding(num, b->second));
+        continue;
+      }
+      auto d = defaults.find(name);
+      if (d == defaults.end()) throw std::runtime_error(format("No value given for variable '{}'", name));
+      vars.push_back(d->second);
+    }
+    return it->second.expr->eval(vars);
+  }
+};
+
+// Throws the error of the last failed system call
+[[noreturn]] inline void sys_error(string_view what) {
+  throw std::runtime_error(format("{}: {}", what, std::strerror(errno)));
+}
+
+// Serves requests on the socket at path until SIGINT or SIGTERM, with
+// threads workers and batches collected for window_us microseconds. Prints
+// the counters when it stops.
+template <typename N>
+void serve(const N& num, const string& path, usize threads, usize window_us,
+           const std::unordered_map<string, typename N::Value>& defaults) {
+  sockaddr_un addr {.sun_family = AF_UNIX};
+  if (path.size() >= sizeof addr.sun_path) throw std::runtime_error(format("Socket path {} is too long", path));
+  std::copy(path.begin(), path.end(), addr.sun_path);
+
+  // stop on a signal through a descriptor the loop waits on
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGPIPE);
+  // the workers inherit the mask
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  int sig = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  // replace the socket of a server that is gone, but nothing else
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) throw std::runtime_error(format("{} exists and is not a socket", path));
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) sys_error("socket");
+    bool live = connect(probe, (const sockaddr*)&addr, sizeof addr) == 0 || (errno != ECONNREFUSED && errno != ENOENT);
+    close(probe);
+    if (live) throw std::runtime_error(format("{} is in use by another server", path));
+    unlink(path.c_str());
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener < 0) sys_error("socket");
+  if (bind(listener, (const sockaddr*)&addr, sizeof addr) != 0) sys_error(format("Cannot bind {}", path));
+  if (listen(listener, SOMAXCONN) != 0) sys_error("listen");
+
+  int done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (sig < 0 || done < 0 || timer < 0 || ep < 0) sys_error("Cannot set up the event loop");
+  auto watch = [&](int fd, u32 events, int op = EPOLL_CTL_ADD) {
+    epoll_event ev {.events = events, .data = {.fd = fd}};
+    if (epoll_ctl(ep, op, fd, &ev) != 0) sys_error("epoll_ctl");
+  };
+  for (int fd: {listener, sig, done, timer}) watch(fd, EPOLLIN);
+
+  // workers push their responses here and ring done
+  std::mutex finished_lock;
+  vector<ServeResponse> finished;
+  DeadlineQueue queue;
+  ServeStats stats;
+  Tiering<N> tiering(num);
+  // moving averages of the time to answer one request by size bucket, for
+  // admission; a parse on a cache miss counts
+  std::array<std::atomic<f64>, SERVE_COST_BUCKETS> cost_us;
+  for (auto& c: cost_us) c.store(1, std::memory_order_relaxed);
+  auto cost_of = [&](string_view payload) -> std::atomic<f64>& {
+    return cost_us[std::min<usize>(std::bit_width(payload.size()), SERVE_COST_BUCKETS - 1)];
+  };
+  vector<std::thread> workers;
+  for (usize w = 0; w < threads; w++) {
+    workers.emplace_back([&] {
+      ServeWorker<N> worker(num, tiering, defaults);
+      vector<ServeRequest> batch;
+      vector<ServeResponse> out;
+      // a share of the queue, so that one worker does not take all of a burst
+      while (queue.pop(batch, std::clamp<usize>(queue.size() / threads, 1, SERVE_MAX_BATCH))) {
+        for (auto& r: batch) {
+          ServeResponse res {r.fd, r.conn, {}};
+          auto start = ServeClock::now();
+          if (start > r.deadline) {
+            serve_response(res.frame, get<u32>(r.payload, 0), ServeStatus::Expired, "Deadline exceeded");
+            stats.expired.fetch_add(1, std::memory_order_relaxed);
+          } else {
+            auto status = worker.answer(r.payload, res.frame);
+            auto end = ServeClock::now();
+            f64 us = std::chrono::duration<f64, std::micro>(end - start).count();
+            auto& cost = cost_of(r.payload);
+            cost.store(0.9 * cost.load(std::memory_order_relaxed) + 0.1 * us, std::memory_order_relaxed);
+            stats.answered.fetch_add(1, std::memory_order_relaxed);
+            if (status != ServeStatus::Ok) stats.errors.fetch_add(1, std::memory_order_relaxed);
+            if (end > r.deadline) stats.late.fetch_add(1, std::memory_order_relaxed);
+          }
+          out.push_back(std::move(res));
+        }
+        batch.clear();
+        {
+          std::lock_guard guard(finished_lock);
+          for (auto& r: out) finished.push_back(std::move(r));
+        }
+        out.clear();
+        u64 one = 1;
+        [[maybe_unused]] auto _ = write(done, &one, sizeof one);
+      }
+    });
+  }
+
+  struct Conn {
+    u64 id;
+    string in, out;
+    // requests read but not yet answered
+    usize in_flight = 0;
+    // the client shut down its end
+    bool eof = false;
+    // what the connection is watched for
+    u32 events = EPOLLIN;
+
+    bool reading() const { return !eof && out.size() < SERVE_MAX_OUT && in_flight < SERVE_MAX_IN_FLIGHT; }
+  };
+  std::unordered_map<int, Conn> conns;
+  u64 next_conn = 0, next_seq = 0;
+  vector<ServeRequest> pending;
+  // of the pending requests with a budget
+  f64 pending_cost = 0;
+  // when the timer sends pending, if it is not sent sooner
+  ServeClock::time_point window_end {};
+
+  auto close_conn = [&](int fd) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    conns.erase(fd);
+  };
+  auto dispatch = [&] {
+    if (pending.empty()) return;
+    itimerspec off {};
+    timerfd_settime(timer, 0, &off, nullptr);
+    queue.push(pending);
+    pending_cost = 0;
+  };
+  // Writes what it can of c.out. False once the connection should be closed,
+  // because writing failed or a client that shut down its end has all its
+  // answers.
+  auto flush = [&](int fd, Conn& c) {
+    while (!c.out.empty()) {
+      isize n = write(fd, c.out.data(), c.out.size());
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (n < 0) return false;
+      c.out.erase(0, n);
+    }
+    if (c.eof && c.in_flight == 0 && c.out.empty()) return false;
+    // ask for EPOLLOUT only while there is something left to write, and
+    // EPOLLIN only while the client is not too far ahead of its answers
+    u32 events = (c.reading() ? u32(EPOLLIN) : 0) | (c.out.empty() ? 0 : u32(EPOLLOUT));
+    if (events != c.events) {
+      c.events = events;
+      watch(fd, events, EPOLL_CTL_MOD);
+    }
+    return true;
+  };
+  auto receive = [&](int fd, Conn& c) {
+    // when the frames being taken arrived
+    ServeClock::time_point now;
+    auto request = [&](string_view payload) {
+      u32 id = payload.size() >= 4 ? get<u32>(payload, 0) : 0;
+      auto kind = payload.size() >= SERVE_HEADER_SIZE ? (ServeKind)get<u16>(payload, 6) : ServeKind::Eval;
+      u32 budget = payload.size() >= SERVE_HEADER_SIZE ? get<u32>(payload, 8) : 0;
+      if (kind != ServeKind::Eval && kind != ServeKind::Stats) {
+        serve_response(c.out, id, ServeStatus::Error, "Malformed request");
+        return;
+      }
+      if (kind == ServeKind::Stats) {
+        serve_response(c.out, id, ServeStatus::Ok, stats.str() + "\n" + tiering.metrics().str());
+        return;
+      }
+      auto deadline = ServeClock::time_point::max();
+      f64 cost = cost_of(payload).load(std::memory_order_relaxed);
+      if (budget != 0) {
+        deadline = now + std::chrono::microseconds(budget);
+        // earliest deadline first puts this request after every queued one with
+        // a deadline in the worst case, and after none without
+        f64 ahead = queue.deadline_cost() + pending_cost;
+        // unless it is sent at once, below, it waits out the window
+        f64 window = 0;
+        if (pending.size() + 1 < SERVE_MAX_BATCH && budget >= 2 * window_us) {
+          window = pending.empty() ? window_us : std::max(0.0, std::chrono::duration<f64, std::micro>(window_end - now).count());
+        }
+        // with nothing ahead it is admitted whatever its estimate, which it refreshes
+        if (ahead > 0 && window + ahead / threads + cost > budget) {
+          serve_response(c.out, id, ServeStatus::Shed, "Shed: would miss its deadline");
+          stats.shed.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        pending_cost += cost;
+      }
+      if (pending.empty() && window_us != 0) {
+        itimerspec at {.it_value = {.tv_sec = (time_t)(window_us / 1'000'000), .tv_nsec = (long)(window_us % 1'000'000 * 1000)}};
+        timerfd_settime(timer, 0, &at, nullptr);
+        window_end = now + std::chrono::microseconds(window_us);
+      }
+      pending.push_back({fd, c.id, string(payload), deadline, cost, next_seq++});
+      c.in_flight++;
+      // a deadline too close to wait out the window goes now
+      if (pending.size() >= SERVE_MAX_BATCH || deadline < now + std::chrono::microseconds(2 * window_us)) dispatch();
+    };
+    // frames are taken after every read, so c.in holds at most one partial
+    // frame and one read
+    char buf[1 << 16];
+    while (c.reading()) {
+      isize n = read(fd, buf, sizeof buf);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (n < 0) return false;
+      if (n == 0) {
+        // a partial frame will never be completed
+        c.eof = true;
+        c.in.clear();
+        break;
+      }
+      c.in.append(buf, n);
+      now = ServeClock::now();
+      if (!take_frames(c.in, request)) return false;
+    }
+    return flush(fd, c);
+  };
+
+  epoll_event events[64];
+  for (bool running = true; running;) {
+    int n = epoll_wait(ep, events, std::size(events), -1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) sys_error("epoll_wait");
+    for (int e = 0; e < n; e++) {
+      int fd = events[e].data.fd;
+      if (fd == sig) {
+        running = false;
+      } else if (fd == listener) {
+        int c;
+        while ((c = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          conns.emplace(c, Conn {.id = next_conn++});
+          watch(c, EPOLLIN);
+        }
+      } else if (fd == timer) {
+        u64 expirations;
+        [[maybe_unused]] auto _ = read(timer, &expirations, sizeof expirations);
+        dispatch();
+      } else if (fd == done) {
+        u64 count;
+        [[maybe_unused]] auto _ = read(done, &count, sizeof count);
+        vector<ServeResponse> ready;
+        {
+          std::lock_guard guard(finished_lock);
+          ready.swap(finished);
+        }
+        for (auto& r: ready) {
+          auto it = conns.find(r.fd);
+          if (it == conns.end() || it->second.id != r.conn) continue;
+          it->second.out += r.frame;
+          it->second.in_flight--;
+        }
+        for (auto& r: ready) {
+          auto it = conns.find(r.fd);
+          if (it != conns.end() && it->second.id == r.conn && !flush(r.fd, it->second)) close_conn(r.fd);
+        }
+      } else {
+        auto it = conns.find(fd);
+        if (it == conns.end()) continue;
+        // a hangup means the client closed both ends and will read no answers
+        bool ok = !(events[e].events & (EPOLLHUP | EPOLLERR));
+        if (ok && events[e].events & EPOLLOUT) ok = flush(fd, it->second);
+        if (ok && events[e].events & EPOLLIN) ok = receive(fd, it->second);
+        if (!ok) close_conn(fd);
+      }
+    }
+    // without a window, everything read in one wakeup is a batch
+    if (window_us == 0) dispatch();
+  }
+
+  queue.close();
+  for (auto& t: workers) t.join();
+  std::cerr << stats.str() << "\n" << tiering.metrics().str() << std::endl;
+  for (auto& [fd, _]: conns) close(fd);
+  for (int fd: {listener, sig, done, timer, ep}) close(fd);
+  unlink(path.c_str());
+}
+
+// Sends source to the server at path at qps requests per second for
+// seconds, spread over connections and in bursts of burst requests, each
+// with a budget of budget_us (0 for none). Prints the latency distribution
+// of the requests that were evaluated and the server's counters. Latency
+// counts from when a request was due rather than when it was sent, so a
+// stalled server is not hidden by the client falling behind.
+inline void load_test(const string& path, string_view source, const vector<pair<string, string>>& bindings, f64 qps,
+                      f64 seconds, usize connections, u32 budget_us, usize burst) {
+  using Clock = std::chrono::steady_clock;
+  sockaddr_un addr {.sun_family = AF_UNIX};
+  if (path.size() >= sizeof addr.sun_path) throw std::runtime_error(format("Socket path {} is too long", path));
+  std::copy(path.begin(), path.end(), addr.sun_path);
+
+  struct Result {
+    vector<f64> micros;
+    usize sent = 0, errors = 0, shed = 0, expired = 0;
+    string failure;
+  };
+  auto connect_to = [&] {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (const sockaddr*)&addr, sizeof addr) == 0) return fd;
+    if (fd >= 0) close(fd);
+    return -1;
+  };
+  vector<Result> results(connections);
+  auto start = Clock::now() + std::chrono::milliseconds(10);
+  auto interval = std::chrono::duration<f64>(connections / qps);
+  usize total = (usize)(qps * seconds / connections);
+
+  vector<std::thread> threads;
+  for (usize t = 0; t < connections; t++) {
+    threads.emplace_back([&, t] {
+      auto& res = results[t];
+      int fd = connect_to();
+      if (fd < 0) {
+        res.failure = format("Cannot connect to {}: {}", path, std::strerror(errno));
+        return;
+      }
+      // the connections' schedules are interleaved, and a burst is due at once
+      auto due = [&](usize i) {
+        return start + std::chrono::duration_cast<Clock::duration>(interval * (i / burst * burst + (f64)t / connections));
+      };
+      string in, frame;
+      char buf[1 << 16];
+      usize received = 0;
+      auto deadline = due(total) + std::chrono::seconds(1);
+      while (received < total && Clock::now() < deadline) {
+        auto now = Clock::now();
+        while (res.sent < total && due(res.sent) <= now) {
+          frame = serve_request((u32)res.sent, bindings, source, budget_us);
+          for (usize done = 0; done < frame.size();) {
+            isize n = write(fd, frame.data() + done, frame.size() - done);
+            if (n < 0) {
+              res.failure = format("Cannot send: {}", std::strerror(errno));
+              close(fd);
+              return;
+            }
+            done += n;
+          }
+          res.sent++;
+        }
+        auto wake = res.sent < total ? due(res.sent) : deadline;
+        auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::max(wake - Clock::now(), Clock::duration::zero()));
+        timespec timeout {.tv_sec = (time_t)(wait.count() / 1'000'000'000), .tv_nsec = (long)(wait.count() % 1'000'000'000)};
+        pollfd p {.fd = fd, .events = POLLIN};
+        if (ppoll(&p, 1, &timeout, nullptr) <= 0) continue;
+        isize n = read(fd, buf, sizeof buf);
+        if (n <= 0) {
+          res.failure = "Server closed the connection";
+          break;
+        }
+        in.append(buf, n);
+        auto arrived = Clock::now();
+        take_frames(in, [&](string_view payload) {
+          u32 id = get<u32>(payload, 0);
+          received++;
+          switch (payload.size() < 5 ? ServeStatus::Error : (ServeStatus)get<u8>(payload, 4)) {
+            case ServeStatus::Shed: res.shed++; return;
+            case ServeStatus::Expired: res.expired++; return;
+            case ServeStatus::Ok: break;
+            default: res.errors++; break;
+          }
+          res.micros.push_back(std::chrono::duration<f64, std::micro>(arrived - due(id)).count());
+        });
+      }
+      close(fd);
+    });
+  }
+  for (auto& t: threads) t.join();
+
+  vector<f64> micros;
+  usize sent = 0, errors = 0, shed = 0, expired = 0;
+  for (auto& r: results) {
+    if (!r.failure.empty()) throw std::runtime_error(r.failure);
+    micros.insert(micros.end(), r.micros.begin(), r.micros.end());
+    sent += r.sent;
+    errors += r.errors;
+    shed += r.shed;
+    expired += r.expired;
+  }
+  std::sort(micros.begin(), micros.end());
+  auto pct = [&](f64 p) { return micros.empty() ? 0.0 : micros[std::min((usize)(p * micros.size()), micros.size() - 1)]; };
+  cout << format("#== Load ==\n{} sent, {} evaluated, {} errors, {} shed, {} expired, {} lost at {:.0f} requests/s\n", sent,
+                 micros.size(), errors, shed, expired, sent - micros.size() - shed - expired, qps);
+  cout << format("p50 {:.1f} us  p99 {:.1f} us  p999 {:.1f} us  max {:.1f} us\n", pct(0.5), pct(0.99), pct(0.999),
+                 micros.empty() ? 0.0 : micros.back());
+
+  // the server's own counters, since it started
+  int fd = connect_to();
+  if (fd < 0) return;
+  string frame = serve_request(0, {}, "", 0, ServeKind::Stats), in;
+  if (write(fd, frame.data(), frame.size()) == (isize)frame.size()) {
+    char buf[1024];
+    isize n;
+    bool answered = false;
+    while (!answered && (n = read(fd, buf, sizeof buf)) > 0) {
+      in.append(buf, n);
+      take_frames(in, [&](string_view payload) {
+        cout << "\n#== Server ==\n" << payload.substr(5) << "\n";
+        answered = true;
+      });
+    }
+  }
+  close(fd);
+}
+
+// pratt --serve-shm NAME answers clients of pratt_shm.h through a ring of
+// slots in shared memory, on one thread. Each expression is tokenized, on a
+// compile cache miss, straight from the slot it was written to, and the
+// result goes back into the same slot. The ring is served in order, so a
+// client that dies between claiming a slot and filling it stalls the ring.
+// The server's pid in the header tells clients, and a server starting with
+// the same name, whether it is still running.
+
+inline std::atomic<bool> shm_stopping = false;
+
+// Serves the ring named name, with slots entries, until SIGINT or SIGTERM
+template <typename N>
+void serve_shm(const N& num, const string& name, u32 slots, const std::unordered_map<string, typename N::Value>& defaults) {
+  if (slots < 4 || !std::has_single_bit(slots)) throw std::runtime_error("The ring needs a power of two of at least 4 slots");
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    // replace the ring of a server that is gone, but nothing else
+    pratt_shm_client old;
+    if (pratt_shm_connect(&old, name.c_str()) == 0) {
+      pratt_shm_disconnect(&old);
+      throw std::runtime_error(format("{} is in use by another server", name));
+    }
+    if (errno != ECONNREFUSED) sys_error(format("{} exists and is not a usable ring", name));
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  }
+  if (fd < 0) sys_error(format("Cannot create {}", name));
+  usize size = pratt_shm_size(slots);
+  void* p = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    sys_error(format("Cannot map {}", name));
+  }
+  auto* header = (pratt_shm_header*)p;
+  pratt_shm_slot* ring = pratt_shm_slots(header);
+  header->version = PRATT_SHM_VERSION;
+  header->slots = slots;
+  header->slot_size = sizeof(pratt_shm_slot);
+  header->owner = getpid();
+  for (u32 i = 0; i < slots; i++) ring[i].seq = i;
+  std::atomic_ref(header->magic).store(PRATT_SHM_MAGIC, std::memory_order_release);
+
+  // without SA_RESTART, so that a sleeping futex wait returns at once
+  struct sigaction stop {};
+  stop.sa_handler = [](int) { shm_stopping.store(true); };
+  sigaction(SIGINT, &stop, nullptr);
+  sigaction(SIGTERM, &stop, nullptr);
+
+  Tiering<N> tiering(num);
+  ServeWorker<N> worker(num, tiering, defaults);
+  string text;
+  std::atomic_ref sleeping(header->sleeping);
+  for (u32 tail = 0; !shm_stopping.load(std::memory_order_relaxed); ) {
+    auto& slot = ring[tail & (slots - 1)];
+    std::atomic_ref seq(slot.seq);
+    // spin while requests keep coming, then sleep until a client wakes us
+    for (usize spins = 0; seq.load(std::memory_order_acquire) != tail + 1 && !shm_stopping.load(std::memory_order_relaxed); spins++) {
+      if (spins < PRATT_SHM_SPINS) continue;
+      sleeping.store(1);
+      if (seq.load() != tail + 1) pratt_shm_wait(&header->sleeping, 1, 100'000'000);
+      sleeping.store(0, std::memory_order_relaxed);
+      spins = 0;
+    }
+    if (seq.load(std::memory_order_acquire) != tail + 1) break;
+
+    text.clear();
+    slot.status = worker.respond(string_view(slot.data, std::min<usize>(slot.size, PRATT_SHM_DATA_SIZE)), text);
+    slot.size = std::min<usize>(text.size(), PRATT_SHM_DATA_SIZE);
+    std::memcpy(slot.data, text.data(), slot.size);
+    seq.store(tail + 2);
+    std::atomic_ref waiting(slot.waiting);
+    if (waiting.load() && waiting.exchange(0)) pratt_shm_wake(&slot.seq);
+    tail++;
+  }
+
+  // clients still waiting give up now rather than at their next check
+  std::atomic_ref(header->owner).store(0, std::memory_order_release);
+  for (u32 i = 0; i < slots; i++) {
+    if (std::atomic_ref(ring[i].waiting).load()) pratt_shm_wake(&ring[i].seq);
+  }
+  munmap(p, size);
+  shm_unlink(name.c_str());
+}
+//== end evaluation server }}}
+
+string read_file(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error(format("Cannot open {}: {}", path, std::strerror(errno)));
+  string res;
+  char buf[1 << 16];
+  isize n;
+  while ((n = read(fd, buf, sizeof buf)) > 0) res.append(buf, n);
+  close(fd);
+  if (n < 0) throw std::runtime_error(format("Cannot read {}: {}", path, std::strerror(errno)));
+  return res;
+}
+
+// Writes data to path, or stdout without one. A file is replaced whole or
+// not at all, so that a build never sees half of one.
+void write_output(const optional<string>& path, string_view data) {
+  string tmp = path.has_value() ? path.value() + ".tmp" : "stdout";
+  int fd = path.has_value() ? open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+  if (fd < 0) throw std::runtime_error(format("Cannot open {}: {}", tmp, std::strerror(errno)));
+  // a failed write leaves neither the descriptor nor the temporary behind
+  auto fail = [&](const string& name) {
+    int err = errno;
+    if (path.has_value()) {
+      if (fd >= 0) close(fd);
+      unlink(tmp.c_str());
+    }
+    throw std::runtime_error(format("Cannot write {}: {}", name, std::strerror(err)));
+  };
+  for (usize done = 0; done < data.size();) {
+    isize w = write(fd, data.data() + done, data.size() - done);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0) fail(tmp);
+    done += w;
+  }
+  if (!path.has_value()) return;
+  int closed = close(fd);
+  fd = -1;
+  if (closed != 0) fail(tmp);
+  if (rename(tmp.c_str(), path->c_str()) != 0) fail(path.value());
+}
+
+// Evaluates the formula of the --load image named source or, failing that,
+// the one with the same optimized tree as source
+template <typename N>
+void run_image(const N& num, string_view source, const Options& opts) {
+  if constexpr (image_backend<N>().empty()) {
+    throw std::runtime_error("--load supports the i32, i64, i128 and f64 backends");
+  } else {
+    auto start = std::chrono::steady_clock::now();
+    auto image = Image<N>::open(opts.load.value());
+    if (opts.verify) image.verify();
+    std::chrono::duration<f64, std::micro> micros = std::chrono::steady_clock::now() - start;
+    cout << format("#== Image ==\n{} formulas, loaded in {:.1f} us\n\n", image.formula_count(), micros.count());
+
+    auto formula = image.find(source);
+    if (!formula.has_value()) {
+      Parser<N> p {.num = num, .tokens = Tokenizer(source).tokenize(), .fold_constants = true};
+      auto expr = p.parse_expr();
+      PassManager<N>::standard().run(num, expr);
+      formula = image.find(expr->hash(num), Bytecode<N>::compile(*expr), p.variables);
+    }
+    if (!formula.has_value()) throw std::runtime_error(format("\"{}\" is not in {}", source, opts.load.value()));
+
+    auto names = formula->variables();
+    auto vars = bind_variables(num, vector<string>(names.begin(), names.end()), opts);
+    std::cout << num.str(formula->eval(num, vars)) << std::endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  // TODO: too much validation at all stages, leading to exceptions peppered throughout
+  // possibly remove things like None from many stages
+  // also, return errors instead of panicking, perhaps
+  
+  if (argc == 1) throw std::runtime_error("No argument!");
+
+  string stream = "";
+  Options opts;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--backend") {
+      if (++i == argc) throw std::runtime_error("--backend requires one of i32, i64, i128, f64, big, rational");
+      opts.backend = argv[i];
+      continue;
+    }
+    if (arg == "--mod") {
+      if (++i == argc) throw std::runtime_error("--mod requires a modulus");
+      string val = argv[i];
+      u64 p = 0;
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), p);
+      if (ec != std::errc{} || end != val.data() + val.size()) {
+        throw std::runtime_error(format("Invalid modulus \"{}\"", val));
+      }
+      opts.modulus = p;
+      continue;
+    }
+    if (arg == "--check") {
+      opts.check = true;
+      continue;
+    }
+    if (arg == "--batch") {
+      opts.batch = true;
+      continue;
+    }
+    if (arg == "--profile") {
+      opts.profile = true;
+      continue;
+    }
+    if (arg == "--bench") {
+      if (++i == argc) throw std::runtime_error("--bench requires a number of rounds");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.bench);
+      if (ec != std::errc{} || end != val.data() + val.size() || opts.bench == 0) {
+        throw std::runtime_error(format("Invalid number of rounds \"{}\"", val));
+      }
+      continue;
+    }
+    if (arg == "--stream") {
+      opts.stream = true;
+      continue;
+    }
+    if (arg == "--threads") {
+      if (++i == argc) throw std::runtime_error("--threads requires a count");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.threads);
+      if (ec != std::errc{} || end != val.data() + val.size()) {
+        throw std::runtime_error(format("Invalid thread count \"{}\"", val));
+      }
+      continue;
+    }
+    if (arg == "--engine") {
+      if (++i == argc) throw std::runtime_error("--engine requires one of tree, closure, vm");
+      opts.engine = argv[i];
+      if (opts.engine != "tree" && opts.engine != "closure" && opts.engine != "vm") throw std::runtime_error(format("Unknown engine \"{}\"", opts.engine));
+      continue;
+    }
+    if (arg == "--emit-cpp") {
+      if (++i == argc) throw std::runtime_error("--emit-cpp requires a file of formulas");
+      opts.emit_cpp = argv[i];
+      continue;
+    }
+    if (arg == "--compile") {
+      if (++i == argc) throw std::runtime_error("--compile requires a file of formulas");
+      opts.compile = argv[i];
+      continue;
+    }
+    if (arg == "--load") {
+      if (++i == argc) throw std::runtime_error("--load requires an image");
+      opts.load = argv[i];
+      continue;
+    }
+    if (arg == "--verify") {
+      opts.verify = true;
+      continue;
+    }
+    if (arg == "--serve") {
+      if (++i == argc) throw std::runtime_error("--serve requires a socket path");
+      opts.serve = argv[i];
+      continue;
+    }
+    if (arg == "--serve-shm") {
+      if (++i == argc) throw std::runtime_error("--serve-shm requires a shared memory name");
+      opts.serve_shm = argv[i];
+      continue;
+    }
+    if (arg == "--slots") {
+      if (++i == argc) throw std::runtime_error("--slots requires a count");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.slots);
+      if (ec != std::errc{} || end != val.data() + val.size()) throw std::runtime_error(format("Invalid slot count \"{}\"", val));
+      continue;
+    }
+    if (arg == "--loadgen") {
+      if (++i == argc) throw std::runtime_error("--loadgen requires a socket path");
+      opts.loadgen = argv[i];
+      continue;
+    }
+    if (arg == "--window") {
+      if (++i == argc) throw std::runtime_error("--window requires a number of microseconds");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.window_us);
+      if (ec != std::errc{} || end != val.data() + val.size()) throw std::runtime_error(format("Invalid window \"{}\"", val));
+      continue;
+    }
+    if (arg == "--qps" || arg == "--duration") {
+      if (++i == argc) throw std::runtime_error(format("{} requires a number", arg));
+      string val = argv[i];
+      f64& out = arg == "--qps" ? opts.qps : opts.duration;
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), out);
+      if (ec != std::errc{} || end != val.data() + val.size() || !(out > 0)) {
+        throw std::runtime_error(format("Invalid {} \"{}\"", arg.substr(2), val));
+      }
+      continue;
+    }
+    if (arg == "--deadline") {
+      if (++i == argc) throw std::runtime_error("--deadline requires a number of microseconds");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.deadline_us);
+      if (ec != std::errc{} || end != val.data() + val.size()) throw std::runtime_error(format("Invalid deadline \"{}\"", val));
+      continue;
+    }
+    if (arg == "--burst") {
+      if (++i == argc) throw std::runtime_error("--burst requires a count");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.burst);
+      if (ec != std::errc{} || end != val.data() + val.size() || opts.burst == 0) {
+        throw std::runtime_error(format("Invalid burst \"{}\"", val));
+      }
+      continue;
+    }
+    if (arg == "--connections") {
+      if (++i == argc) throw std::runtime_error("--connections requires a count");
+      string val = argv[i];
+      auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), opts.connections);
+      if (ec != std::errc{} || end != val.data() + val.size() || opts.connections == 0) {
+        throw std::runtime_error(format("Invalid connection count \"{}\"", val));
+      }
+      continue;
+    }
+    if (arg == "--output") {
+      if (++i == argc) throw std::runtime_error("--output requires a file");
+      opts.output = argv[i];
+      continue;
+    }
+    if (arg == "--namespace") {
+      if (++i == argc) throw std::runtime_error("--namespace requires a name");
+      opts.cpp_namespace = argv[i];
+      continue;
+    }
+    if (arg == "--input") {
+      if (++i == argc) throw std::runtime_error("--input requires a file");
+      opts.input = argv[i];
+      continue;
+    }
+    if (arg == "--optimize") {
+      opts.optimize = true;
+      continue;
+    }
+    if (arg == "--fold") {
+      opts.fold_constants = true;
+      continue;
+    }
+    if (arg == "--let") {
+      if (++i == argc) throw std::runtime_error("--let requires name=value");
+      string val = argv[i];
+      auto eq = val.find('=');
+      if (eq == string::npos) throw std::runtime_error(format("Invalid binding \"{}\", expected name=value", val));
+      opts.bindings.emplace_back(val.substr(0, eq), val.substr(eq + 1));
+      continue;
+    }
+    if (stream != "") {
+      throw std::runtime_error("Too many arguments");
+    }
+    stream = arg;
+  }
+
+  // the file to read replaces the argument
+  if (opts.input.has_value()) {
+    if (stream != "") throw std::runtime_error("Give either an argument or --input, not both");
+  }
+
+  if (opts.emit_cpp.has_value()) {
+    string source = read_file(opts.emit_cpp.value());
+    string header;
+    with_backend(opts, [&](const auto& num) { header = emit_cpp(num, source, opts.emit_cpp.value(), opts.cpp_namespace); });
+    write_output(opts.output, header);
+    return 0;
+  }
+
+  if (opts.compile.has_value()) {
+    string source = read_file(opts.compile.value());
+    string image;
+    with_backend(opts, [&](const auto& num) { image = compile_image(num, source, opts.compile.value()); });
+    write_output(opts.output, image);
+    return 0;
+  }
+
+  if (opts.serve.has_value()) {
+    // --threads is the number of workers
+    usize threads = opts.threads != 0 ? opts.threads : std::max(std::thread::hardware_concurrency(), 1u);
+    with_backend(opts, [&](const auto& num) {
+      std::unordered_map<string, typename std::decay_t<decltype(num)>::Value> defaults;
+      for (const auto& [name, source]: opts.bindings) defaults.insert_or_assign(name, eval_binding(num, source));
+      serve(num, opts.serve.value(), threads, opts.window_us, defaults);
+    });
+    return 0;
+  }
+
+  if (opts.serve_shm.has_value()) {
+    with_backend(opts, [&](const auto& num) {
+      std::unordered_map<string, typename std::decay_t<decltype(num)>::Value> defaults;
+      for (const auto& [name, source]: opts.bindings) defaults.insert_or_assign(name, eval_binding(num, source));
+      serve_shm(num, opts.serve_shm.value(), opts.slots, defaults);
+    });
+    return 0;
+  }
+
+  if (opts.loadgen.has_value()) {
+    load_test(opts.loadgen.value(), stream, opts.bindings, opts.qps, opts.duration, opts.connections, opts.deadline_us, opts.burst);
+    return 0;
+  }
+
+  if (opts.load.has_value()) {
+    with_backend(opts, [&](const auto& num) { run_image(num, stream, opts); });
+    return 0;
+  }
+
+  if (opts.check) {
+    // without an argument, check each line of stdin or --input
+    bool ok = true;
+    auto report = [&](string_view src) {
+      auto err = check_syntax(src);
+      if (err.has_value()) cout << "error at byte " << err.value() << "\n";
+      else cout << "ok\n";
+      ok = ok && !err.has_value();
+    };
+    if (stream != "") {
+      report(stream);
+    } else if (opts.input.has_value()) {
+      // or each line of the file
+      string text = read_file(opts.input.value());
+      string_view rest = text;
+      while (!rest.empty()) {
+        usize end = std::min(rest.find('\n'), rest.size());
+        report(rest.substr(0, end));
+        rest.remove_prefix(std::min(end + 1, rest.size()));
+      }
+    } else {
+      std::ios::sync_with_stdio(false);
+      string line;
+      while (std::getline(std::cin, line)) report(line);
+    }
+    return ok ? 0 : 1;
+  }
+
+  if (opts.stream || opts.batch || opts.profile || opts.bench != 0) {
+    // the argument or --input, if any, is a file to read instead of stdin
+    string path = opts.input.value_or(stream);
+    int fd = 0;
+    if (path != "" && path != "-") {
+      fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) throw std::runtime_error(format("Cannot open {}: {}", path, std::strerror(errno)));
+    }
+    if (opts.profile) with_backend(opts, [&](const auto& num) { run_profile(num, fd, opts); });
+    else if (opts.bench != 0) with_backend(opts, [&](const auto& num) { run_bench(num, fd, opts); });
+    else if (opts.batch) with_backend(opts, [&](const auto& num) { run_batch(num, fd, opts); });
+    else with_backend(opts, [&](const auto& num) { run_stream(num, fd, opts); });
+    if (fd != 0) close(fd);
+    return 0;
+  }
+
+  // with --input the expression is the file's content, which may be large
+  if (opts.input.has_value()) stream = read_file(opts.input.value());
+
+  optional<WorkStealingPool> pool;
+  if (opts.threads != 1) pool.emplace(opts.threads != 0 ? opts.threads : std::max(std::thread::hardware_concurrency(), 1u));
+
+  auto tokens = pool.has_value() ? tokenize_parallel({(const u8*)stream.data(), stream.size()}, pool.value())
+                                 : Tokenizer(stream).tokenize();
+
+  if (opts.print_tokens) {
+    cout << "#== Tokens ==\n";
+
+    for (auto tok: tokens) {
+      std::cout << tok.str() << "\n";
+    }
+
+    cout << "\n";
+  }
 
-  std::cout << result << std::endl;
+  with_backend(opts, [&](const auto& num) { run(num, tokens, opts, pool.has_value() ? &pool.value() : nullptr); });
 
   return 0;
 }
+#endif
@@ -0,0 +1,77 @@
+/* C interface to the pratt evaluator, built as libpratt.
+ *
+ * A context holds a numeric backend, named bindings, scratch space and the
+ * last error; use one per thread. Compiled expressions may be shared between
+ * threads and between contexts of the same backend. They start out
+ * interpreted, and a thread of the context that compiled them, started by
+ * its first pratt_compile, recompiles those that are evaluated often; it
+ * stays until the context and every expression it compiled are freed. There
+ * is no global state.
+ *
+ * Functions that can fail return NULL or a nonzero status and leave a
+ * message in pratt_error(ctx), valid until the next call with ctx. Each call
+ * with ctx clears it first, so after a success it is empty.
+ */
+#ifndef PRATT_H
+#define PRATT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define PRATT_API __attribute__((visibility("default")))
+#else
+#define PRATT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pratt_ctx pratt_ctx;
+typedef struct pratt_expr pratt_expr;
+
+/* i for the i32 and i64 backends, f for f64 */
+typedef union pratt_value {
+  int64_t i;
+  double f;
+} pratt_value;
+
+/* backend is "i32", "i64" or "f64". Returns NULL for any other. */
+PRATT_API pratt_ctx* pratt_ctx_new(const char* backend);
+PRATT_API void pratt_ctx_free(pratt_ctx* ctx);
+PRATT_API const char* pratt_error(const pratt_ctx* ctx);
+
+/* Sets the value of a variable for pratt_eval_strings */
+PRATT_API int pratt_bind(pratt_ctx* ctx, const char* name, pratt_value value);
+
+/* Parses, folds and compiles len bytes of src */
+PRATT_API pratt_expr* pratt_compile(pratt_ctx* ctx, const char* src, size_t len);
+PRATT_API void pratt_expr_free(pratt_expr* expr);
+
+/* Variables of expr, in the order pratt_eval expects their values */
+PRATT_API size_t pratt_expr_variable_count(const pratt_expr* expr);
+PRATT_API const char* pratt_expr_variable(const pratt_expr* expr, size_t slot);
+
+/* Evaluates expr with vars[slot] for each variable */
+PRATT_API int pratt_eval(pratt_ctx* ctx, const pratt_expr* expr, const pratt_value* vars, size_t var_count,
+                         pratt_value* out);
+
+/* Batch entry points. Each evaluates count rows, writing out[row] and
+ * status[row] (0 on success), and returns the number of rows that failed;
+ * pratt_error(ctx) then describes the first of them. */
+
+/* Compiles and evaluates srcs[row], lens[row] bytes long (NUL-terminated if
+ * lens is NULL), with the variables set by pratt_bind */
+PRATT_API size_t pratt_eval_strings(pratt_ctx* ctx, const char* const* srcs, const size_t* lens, size_t count,
+                                    pratt_value* out, int* status);
+
+/* Evaluates expr once per row of vars, which holds var_count values per row */
+PRATT_API size_t pratt_eval_rows(pratt_ctx* ctx, const pratt_expr* expr, const pratt_value* vars, size_t var_count,
+                                 size_t count, pratt_value* out, int* status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
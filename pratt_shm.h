@@ -0,0 +1,206 @@
+/* Shared-memory transport to a pratt --serve-shm server, and its client.
+ *
+ * The server creates a POSIX shared memory object holding a header and a
+ * ring of slots. A client claims the next position in the ring, writes an
+ * expression into the slot, and waits; the server evaluates the expression
+ * where it lies and writes the result back into the same slot. While both
+ * sides are busy nothing makes a system call: each spins on the slot's
+ * sequence number for a while before sleeping on it with a futex.
+ *
+ * The header holds the pid of the server. A client waiting for a slot or a
+ * response checks it every PRATT_SHM_CHECK_NS, so that it gives up instead
+ * of waiting forever once the server is gone.
+ *
+ * A slot's sequence number, for ring position pos:
+ *   pos          free, a client may claim pos
+ *   pos + 1      holds a request
+ *   pos + 2      holds the response
+ *   pos + slots  released by the client, free for the next lap
+ */
+#ifndef PRATT_SHM_H
+#define PRATT_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PRATT_SHM_MAGIC 0x4d485350u /* "PSHM" */
+#define PRATT_SHM_VERSION 2u
+/* a slot is one page */
+#define PRATT_SHM_DATA_SIZE (4096 - 16)
+/* polls of a sequence number before sleeping on it */
+#define PRATT_SHM_SPINS 4096
+/* how often a waiting client checks that the server is still there */
+#define PRATT_SHM_CHECK_NS 10000000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pratt_shm_slot {
+  uint32_t seq;
+  /* 1 while the client sleeps on seq */
+  uint32_t waiting;
+  /* bytes of data: the expression, then the result or error message */
+  uint32_t size;
+  /* 0 if the expression evaluated, 1 if data is an error */
+  uint32_t status;
+  char data[PRATT_SHM_DATA_SIZE];
+} pratt_shm_slot;
+
+typedef struct pratt_shm_header {
+  /* set last when the server is ready */
+  uint32_t magic;
+  uint32_t version;
+  /* a power of two, at least 4 */
+  uint32_t slots;
+  uint32_t slot_size;
+  /* the server's pid, 0 once it has stopped */
+  uint32_t owner;
+  char pad0[44];
+  /* the next position to claim */
+  uint32_t head;
+  char pad1[60];
+  /* 1 while the server sleeps on it */
+  uint32_t sleeping;
+  char pad2[4096 - 132];
+  /* followed by the slots */
+} pratt_shm_header;
+
+static inline pratt_shm_slot* pratt_shm_slots(pratt_shm_header* h) { return (pratt_shm_slot*)(h + 1); }
+
+static inline size_t pratt_shm_size(uint32_t slots) {
+  return sizeof(pratt_shm_header) + (size_t)slots * sizeof(pratt_shm_slot);
+}
+
+/* Sleeps while *word is expected, for at most timeout_ns if it is not 0 */
+static inline void pratt_shm_wait(uint32_t* word, uint32_t expected, long timeout_ns) {
+  struct timespec ts = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+  syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout_ns != 0 ? &ts : NULL, NULL, 0);
+}
+
+static inline void pratt_shm_wake(uint32_t* word) { syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0); }
+
+/* Whether the server that owns h is still running */
+static inline int pratt_shm_alive(pratt_shm_header* h) {
+  pid_t owner = (pid_t)__atomic_load_n(&h->owner, __ATOMIC_ACQUIRE);
+  return owner != 0 && (kill(owner, 0) == 0 || errno == EPERM);
+}
+
+typedef struct pratt_shm_client {
+  pratt_shm_header* header;
+  size_t size;
+} pratt_shm_client;
+
+/* Maps the ring of the server started with --serve-shm name. Returns 0, or
+ * -1 with errno set (EPROTO if the server is not ready or incompatible,
+ * ECONNREFUSED if it is gone). */
+static inline int pratt_shm_connect(pratt_shm_client* c, const char* name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(pratt_shm_header)) {
+    close(fd);
+    errno = EPROTO;
+    return -1;
+  }
+  void* p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) return -1;
+  pratt_shm_header* h = (pratt_shm_header*)p;
+  if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != PRATT_SHM_MAGIC || h->version != PRATT_SHM_VERSION ||
+      h->slot_size != sizeof(pratt_shm_slot) || (size_t)st.st_size < pratt_shm_size(h->slots)) {
+    munmap(p, st.st_size);
+    errno = EPROTO;
+    return -1;
+  }
+  if (!pratt_shm_alive(h)) {
+    munmap(p, st.st_size);
+    errno = ECONNREFUSED;
+    return -1;
+  }
+  c->header = h;
+  c->size = st.st_size;
+  return 0;
+}
+
+static inline void pratt_shm_disconnect(pratt_shm_client* c) {
+  munmap(c->header, c->size);
+  c->header = NULL;
+}
+
+/* Evaluates len bytes of src with the server's --let bindings and copies
+ * the result, or the error message, NUL-terminated into out. Returns 0 if
+ * the expression evaluated, 1 if it failed, and -1 with errno set to
+ * EMSGSIZE if src does not fit in a slot or EPIPE if the server is gone.
+ * Safe to call from several threads and processes at once. */
+static inline int pratt_shm_eval(pratt_shm_client* c, const char* src, size_t len, char* out, size_t cap) {
+  pratt_shm_header* h = c->header;
+  if (len > PRATT_SHM_DATA_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  /* claim a position whose slot is free; the ring is full while it is not */
+  uint32_t pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+  pratt_shm_slot* slot;
+  for (unsigned spins = 0;; spins++) {
+    slot = &pratt_shm_slots(h)[pos & (h->slots - 1)];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n(&h->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else {
+      if (spins >= PRATT_SHM_SPINS) sched_yield();
+      if (spins % PRATT_SHM_SPINS == PRATT_SHM_SPINS - 1 && !pratt_shm_alive(h)) {
+        errno = EPIPE;
+        return -1;
+      }
+      pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(slot->data, src, len);
+  slot->size = (uint32_t)len;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&h->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&h->sleeping, 0, __ATOMIC_SEQ_CST)) {
+    pratt_shm_wake(&h->sleeping);
+  }
+
+  for (unsigned spins = 0; __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 2; spins++) {
+    if (spins < PRATT_SHM_SPINS) continue;
+    __atomic_store_n(&slot->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos + 1) continue;
+    pratt_shm_wait(&slot->seq, pos + 1, PRATT_SHM_CHECK_NS);
+    /* the slot stays claimed, but the ring has no server to free it */
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1 && !pratt_shm_alive(h)) {
+      errno = EPIPE;
+      return -1;
+    }
+  }
+
+  __atomic_store_n(&slot->waiting, 0, __ATOMIC_RELAXED);
+  int status = slot->status != 0;
+  if (cap != 0) {
+    size_t n = slot->size < cap - 1 ? slot->size : cap - 1;
+    memcpy(out, slot->data, n);
+    out[n] = '\0';
+  }
+  __atomic_store_n(&slot->seq, pos + h->slots, __ATOMIC_RELEASE);
+  return status;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,99 @@
+/* Round-trip latency of a pratt --serve-shm server, from C.
+ *
+ *   pratt_shm_bench NAME EXPR [REQUESTS [THREADS]]
+ *
+ * Each thread sends EXPR REQUESTS times, one request at a time, and the
+ * percentiles are over all of them.
+ */
+#include "pratt_shm.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct run {
+  pratt_shm_client* client;
+  const char* src;
+  size_t len;
+  long requests;
+  double* micros;
+  long errors;
+};
+
+static double now_micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void* send_all(void* arg) {
+  struct run* r = arg;
+  char out[256];
+  for (long i = 0; i < r->requests; i++) {
+    double start = now_micros();
+    int status = pratt_shm_eval(r->client, r->src, r->len, out, sizeof out);
+    r->micros[i] = now_micros() - start;
+    /* too long, or the server is gone: every other request would fail too */
+    if (status < 0) {
+      fprintf(stderr, "error: %s\n", strerror(errno));
+      exit(1);
+    }
+    if (status != 0 && r->errors++ == 0) fprintf(stderr, "error: %s\n", out);
+  }
+  return NULL;
+}
+
+static int compare(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s NAME EXPR [REQUESTS [THREADS]]\n", argv[0]);
+    return 2;
+  }
+  long requests = argc > 3 ? atol(argv[3]) : 100000;
+  long threads = argc > 4 ? atol(argv[4]) : 1;
+  if (requests <= 0 || threads <= 0) {
+    fprintf(stderr, "REQUESTS and THREADS must be positive\n");
+    return 2;
+  }
+
+  pratt_shm_client client;
+  if (pratt_shm_connect(&client, argv[1]) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  double* micros = malloc(sizeof(double) * requests * threads);
+  struct run* runs = calloc(threads, sizeof(struct run));
+  pthread_t* ids = calloc(threads, sizeof(pthread_t));
+  if (micros == NULL || runs == NULL || ids == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  double start = now_micros();
+  for (long t = 0; t < threads; t++) {
+    runs[t] = (struct run){&client, argv[2], strlen(argv[2]), requests, micros + t * requests, 0};
+    pthread_create(&ids[t], NULL, send_all, &runs[t]);
+  }
+  long errors = 0;
+  for (long t = 0; t < threads; t++) {
+    pthread_join(ids[t], NULL);
+    errors += runs[t].errors;
+  }
+  double elapsed = now_micros() - start;
+
+  long n = requests * threads;
+  qsort(micros, n, sizeof(double), compare);
+  printf("%ld requests, %ld errors, %.0f requests/s\n", n, errors, n / (elapsed / 1e6));
+  printf("p50 %.2f us  p99 %.2f us  p999 %.2f us  max %.2f us\n", micros[n / 2], micros[n * 99 / 100], micros[n * 999 / 1000],
+         micros[n - 1]);
+
+  free(ids);
+  free(runs);
+  free(micros);
+  pratt_shm_disconnect(&client);
+  return 0;
+}